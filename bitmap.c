@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
@@ -5,8 +8,21 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "bitmap.h"
+#include "shm_ring.h"
+#include "trace.h"
 
 #define BMP_HEADER_SIZE 0x36 // Assuming windows format
 #define SIZE_OFFSET 0x02
@@ -15,10 +31,52 @@
 #define HEIGHT_OFFSET 0x16
 #define PIXEL_SIZE_OFFSET 0x1C
 #define DATA_SIZE_OFFSET 0x22
+#define DIB_SIZE_OFFSET 0x0E
+#define COMPRESSION_OFFSET 0x1E
+#define COLORS_USED_OFFSET 0x2E
+
+// Compression types of palette images
+#define BI_RLE8 1
+#define BI_RLE4 2
 
 #define DFRow 12
 #define DFCol 8
 
+// Columns of guard pattern before the first data frame
+#define GUARD_COLS 3
+
+// Largest layout a symbology can describe
+#define MAX_FRAMES 16
+#define MAX_FRAME_BITS 16
+#define MAX_ROW_WORDS ((MAX_FRAMES * MAX_FRAME_BITS + 63) / 64)
+
+// Row ranges wider than this are read one row per pread, narrower gaps
+// are cheaper to read through than to skip with another syscall
+#define ROI_SKIP_BYTES 4096
+
+// Bytes read per pread when reading through gaps
+#define ROI_CHUNK_BYTES (256 * 1024)
+
+// Reference counted block of pixel memory
+// Copies and views of an image point into the same store, a row is only
+// copied out into a store of its own when it is written to
+typedef struct {
+    // Number of image rows (over all images) pointing into this store
+    int refs;
+
+    // Number of images sharing each row of the store
+    int *row_refs;
+
+    unsigned int height;
+    unsigned int width;
+
+    // Pointers to each pixel, rows back to back
+    unsigned char **row_pixels;
+
+    // 3 bytes per pixel, rows back to back
+    unsigned char *data;
+} PixelStore;
+
 typedef struct {
     uint32_t file_size;
     uint32_t pixel_array_offset;    
@@ -29,354 +87,4874 @@ typedef struct {
     uint32_t data_size;
 
     uint8_t *raw;
+
+    // The store each row of the image lives in
+    PixelStore **row_store;
 } BmpHeader;
 
-void check_fp(FILE *fp, char *filename) {
-    if(fp == NULL) {
-        fprintf(stderr, "Could not open file %s\n", filename);
-        exit(1);
-    }
-}
+// Layout of one kind of barcode label
+typedef struct Symbology {
+    char *name;
 
-void assert_file_format(bool condition) {
-    if (!condition) {
-        fprintf(stderr, "File format error\n");
-        exit(1);
-    }
-}
+    // Number of frames (digits) in a row and bits in each frame
+    int frames;
+    int frame_bits;
 
-Bmp read_bmp(char *filename) {
+    // Columns of guard pattern before and after the data frames
+    int guard_left;
+    int guard_right;
 
-    FILE *fp = fopen(filename, "r");
-    check_fp(fp, filename);
+    // Positions of the data bits in a frame, most significant first
+    int data_bit_count;
+    int data_bits[MAX_FRAME_BITS];
 
-    // Struct to return results
-    Bmp bmp;
-    bmp.header = malloc(sizeof(BmpHeader));
-    BmpHeader *header = bmp.header;
+    // Each parity bit is the even parity of the bits in its mask
+    int parity_count;
+    int parity_bits[MAX_FRAME_BITS];
+    uint32_t parity_masks[MAX_FRAME_BITS];
 
-    // Read in standard header
-    uint8_t standard_header[BMP_HEADER_SIZE];
-    size_t bytes_read = fread(standard_header, 1, BMP_HEADER_SIZE, fp);
-    assert_file_format(bytes_read == BMP_HEADER_SIZE);
+    // Character printed for each data value
+    char *digits;
 
-    // Check file type
-    assert_file_format(standard_header[0] == 'B' && standard_header[1] == 'M');
-    //printf("%x\t%x\n", standard_header, *(uint32_t *)(standard_header + SIZE_OFFSET));
+    // Lookup tables indexed by frame value, filled in by init_symbology
+    uint8_t *valid;
+    char *digit;
 
-    header->file_size = *((uint32_t *)(standard_header + SIZE_OFFSET));
-    header->pixel_array_offset =  *((uint32_t *)(standard_header + PIXEL_ARRAY_OFFSET));
+    // Row kernel, specialised for the common layouts
+    void (*decode_row)(const struct Symbology *sym, const uint64_t *bits, uint16_t *values, int *valid);
+} Symbology;
 
-    header->pixel_size = *((uint16_t *)(standard_header + PIXEL_SIZE_OFFSET)); // Pi
-    assert_file_format(header->pixel_size == 24);
+// Large image buffers can be mapped so they sit on huge pages, which cuts
+// TLB misses on big captures. Off unless asked for with -H
+typedef enum {
+    // Plain malloc
+    HUGEPAGES_OFF,
 
-    header->width =  *((uint32_t *)(standard_header + WIDTH_OFFSET));
-    header->height =  *((uint32_t *)(standard_header + HEIGHT_OFFSET));
+    // Transparent huge pages, asked for with madvise
+    HUGEPAGES_THP,
 
-    header->row_size = ((header->pixel_size * header->width + 31) / 32) * 4;
+    // MAP_HUGETLB from the reserved pool, or THP when the pool runs out
+    HUGEPAGES_HUGETLB
+} HugepageMode;
 
-    #ifdef DEBUG
-    printf("Row size %u\n",header->row_size);
-    #endif
+HugepageMode hugepage_mode = HUGEPAGES_OFF;
 
-    header->data_size = *((uint32_t *)(standard_header + 0x22));
+// Buffers smaller than a huge page come from malloc whatever the mode
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
 
-    // Read in entire header (everything but pixel array)
-    rewind(fp);
-    header->raw = malloc(sizeof(unsigned char) * header->pixel_array_offset);
-    assert_file_format(header->raw != NULL);
-    bytes_read = fread(header->raw, 1, header->pixel_array_offset, fp);
+// With -N, workers are pinned to NUMA nodes, and a mapped buffer freed is
+// kept in a pool for its node so the next one there reuses local memory
+#define MAX_NODES 64
+#define NODE_POOL_BLOCKS 8
 
-    // Read in rest of file
-    char *raw_image = malloc(header->data_size);
-    bytes_read = fread(raw_image, 1, header->data_size, fp);
-    assert_file_format(bytes_read == header->data_size);
+// In front of every image buffer, padded to keep the buffer 64 byte aligned
+typedef struct {
+    // Bytes mapped, including this header, 0 if from malloc
+    size_t length;
 
-    // Allocate columns
-    bmp.pixels = malloc(header->height * sizeof(unsigned char **));
-    for (int i = 0; i < header->height; i++) {
+    // Node pool the buffer goes back to, -1 for none
+    int node;
+    char pad[52];
+} ImageBlock;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int count;
+    ImageBlock *blocks[NODE_POOL_BLOCKS];
+} NodePool;
 
-        // Allocate rows
-        bmp.pixels[i] = malloc(header->width * sizeof(unsigned char *));
-        assert_file_format(bmp.pixels[i] != NULL);
+// Nodes workers are spread over, 0 when they are not pinned
+int numa_nodes;
+cpu_set_t node_cpus[MAX_NODES];
+NodePool node_pools[MAX_NODES];
 
-        for (int j = 0; j < header->width; j++) {
+// Node the calling thread is pinned to, -1 if none
+__thread int thread_node = -1;
 
-            // Allocate pixels
-            bmp.pixels[i][j] = malloc(3 * sizeof(unsigned char)); 
-            assert_file_format(bmp.pixels[i][j] != NULL);
+// Take a buffer of at least length bytes from a node's pool
+ImageBlock *take_pooled_block(int node, size_t length) {
+    NodePool *pool = &node_pools[node];
+    ImageBlock *block = NULL;
+    pthread_mutex_lock(&pool->lock);
+    for(int i = 0; i < pool->count && block == NULL; i++){
+        if(pool->blocks[i]->length >= length){
+            block = pool->blocks[i];
+            pool->blocks[i] = pool->blocks[--pool->count];
         }
     }
+    pthread_mutex_unlock(&pool->lock);
+    return block;
+}
 
-    // Read in each pixel
-    for (int y = 0; y < header->height; y++) {
-        for (int x = 0; x < header->width; x++) {
-            
-            // Read in each pixel
-            bmp.pixels[y][x][BLUE] = *((unsigned char *)(raw_image + y * header->row_size + header->pixel_size/8 * x + 0));
-            bmp.pixels[y][x][GREEN] = *((unsigned char *)(raw_image + y * header->row_size + header->pixel_size/8 * x + 1));
-            bmp.pixels[y][x][RED] = *((unsigned char *)(raw_image + y * header->row_size + header->pixel_size/8 * x + 2));
+// Allocate a buffer for image data, free it with image_free
+// Returns NULL if there is no memory
+void *image_alloc(size_t size) {
+    size_t length = sizeof(ImageBlock) + size;
+    ImageBlock *block = NULL;
+    if(hugepage_mode == HUGEPAGES_OFF || length < HUGEPAGE_SIZE){
+        block = malloc(length);
+        if(block == NULL){
+            return NULL;
         }
+        block->length = 0;
+        block->node = -1;
+        return block + 1;
     }
 
-    free(raw_image);
-    fclose(fp);
-    assert_file_format(header->data_size + header->pixel_array_offset == header->file_size);
-
-    // Write height and width inside output bmp wrapper
-    bmp.height = header->height;
-    bmp.width = header->width;
-
+    length = (length + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+    if(thread_node >= 0 && (block = take_pooled_block(thread_node, length)) != NULL){
+        return block + 1;
+    }
 
-    return bmp;
+    void *map = MAP_FAILED;
+    if(hugepage_mode == HUGEPAGES_HUGETLB){
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if(map == MAP_FAILED){
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(map == MAP_FAILED){
+            return NULL;
+        }
+        madvise(map, length, MADV_HUGEPAGE);
+    }
+    block = map;
+    block->length = length;
+    block->node = thread_node;
+    return block + 1;
 }
 
-void assert_write(bool condition) {
-    if (!condition) {
-        fprintf(stderr, "file write error\n");
-        exit(1);
+void image_free(void *buffer) {
+    if(buffer == NULL){
+        return;
+    }
+    ImageBlock *block = (ImageBlock *)buffer - 1;
+    if(block->length == 0){
+        free(block);
+        return;
+    }
+
+    if(block->node >= 0){
+        NodePool *pool = &node_pools[block->node];
+        pthread_mutex_lock(&pool->lock);
+        bool kept = pool->count < NODE_POOL_BLOCKS;
+        if(kept){
+            pool->blocks[pool->count++] = block;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if(kept){
+            return;
+        }
     }
+    munmap(block, block->length);
 }
 
-void write_bmp(Bmp bmp, char *filename) {
+// Read the CPUs of each NUMA node from sysfs, a list like "0-3,8-11"
+// Node numbers can have gaps, and nodes with memory but no CPUs are left
+// out since no worker could be pinned to them
+// Returns the number of nodes, 1 covering every CPU if sysfs has none
+int find_numa_nodes(void) {
+    int nodes = 0;
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    while(dir != NULL && nodes < MAX_NODES && (entry = readdir(dir)) != NULL){
+        int id;
+        char extra;
+        if(sscanf(entry->d_name, "node%d%c", &id, &extra) != 1){
+            continue;
+        }
+        char path[320];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if(fp == NULL){
+            continue;
+        }
+        CPU_ZERO(&node_cpus[nodes]);
+        int first, last;
+        while(fscanf(fp, "%d", &first) == 1){
+            last = first;
+            if(fscanf(fp, "-%d", &last) != 1){
+                last = first;
+            }
+            for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++){
+                CPU_SET(cpu, &node_cpus[nodes]);
+            }
+            if(fgetc(fp) != ','){
+                break;
+            }
+        }
+        fclose(fp);
+        if(CPU_COUNT(&node_cpus[nodes]) > 0){
+            nodes++;
+        }
+    }
+    if(dir != NULL){
+        closedir(dir);
+    }
 
-    FILE *fp = fopen(filename, "w");
-    check_fp(fp, filename);
+    if(nodes == 0){
+        sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[0]);
+        nodes = 1;
+    }
+    for(int i = 0; i < nodes; i++){
+        pthread_mutex_init(&node_pools[i].lock, NULL);
+    }
+    return nodes;
+}
 
-    BmpHeader *header = (BmpHeader *)bmp.header;
+// Run the calling thread on a node's CPUs, so the memory it first touches
+// is allocated there
+void pin_to_node(int node) {
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[node]) == 0){
+        thread_node = node;
+    }
+}
 
-    // Write entire header (everything but pixel array)
-    size_t bytes_written = fwrite(header->raw, 1, header->pixel_array_offset, fp);
-    assert_write(bytes_written == header->pixel_array_offset);
+// A batch sets a recovery point on each thread around the work on an
+// image, so a bad image fails on its own instead of ending the run
+// Without one, errors print and exit
+__thread jmp_buf *image_recovery;
+__thread const char *image_error;
 
-    // Write rest of file
-    // Loop backward through rows (image indexed from bottom left
-    for (int y = 0; y < header->height; y++) {
-        for (int x = 0; x < header->width; x++) {
+// Descriptor of the image file being read, or the stream it was opened
+// as, closed if the image fails, the buffer it is being read into, freed,
+// the image being built from it, freed as far as it got, and the
+// threshold levels picked for it, freed
+__thread int image_fd = -1;
+__thread FILE *image_fp;
+__thread uint8_t *image_file;
+__thread Bmp *image_bmp;
+__thread uint8_t *image_levels;
 
-            unsigned char *pixel = bmp.pixels[y][x];
-            fwrite(&pixel[BLUE], 1, 1, fp);
-            fwrite(&pixel[GREEN], 1, 1, fp);
-            fwrite(&pixel[RED], 1, 1, fp);
+void fail_image(const char *message, const char *filename) {
+    if(image_recovery != NULL){
+        if(image_fp != NULL){
+            fclose(image_fp);
+            image_fp = NULL;
+        }else if(image_fd >= 0){
+            close(image_fd);
         }
-
-        // Write padding
-        if ((header->width * 3) % 4 != 0) {
-            char null_byte = 0x00;
-            for (int i = 0; i < 4 - (header->width * 3) % 4; i++) {
-                fwrite(&null_byte, 1, 1, fp);
-            }
+        image_fd = -1;
+        image_free(image_file);
+        image_file = NULL;
+        if(image_bmp != NULL){
+            free_bmp(*image_bmp);
+            image_bmp = NULL;
         }
+        free(image_levels);
+        image_levels = NULL;
+        image_error = message;
+        longjmp(*image_recovery, 1);
+    }
+    if(filename != NULL){
+        fprintf(stderr, "%s %s\n", message, filename);
+    }else{
+        fprintf(stderr, "%s\n", message);
     }
+    exit(1);
+}
 
-    fclose(fp);
+// Errors from opening or reading a file say nothing about the image in
+// it, a batch journal leaves them out so a resumed run tries it again
+const char image_open_error[] = "Could not open file";
+const char image_read_error[] = "Could not read file";
+
+void check_fp(FILE *fp, char *filename) {
+    if(fp == NULL) {
+        fail_image(image_open_error, filename);
+    }
 }
 
-void assert_copy(bool condition) {
+void check_fd(int fd, char *filename) {
+    if(fd < 0) {
+        fail_image(image_open_error, filename);
+    }
+}
+
+void assert_file_format(bool condition) {
     if (!condition) {
-        fprintf(stderr, "file write error\n");
-        exit(1);
+        fail_image("File format error", NULL);
     }
 }
 
-// Copy a bmp image
-Bmp copy_bmp(Bmp old_bmp) {
+// Check a read of wanted bytes: a failed read is an error reading, one
+// that stopped short a file that is cut short
+void check_read(ssize_t got, size_t wanted) {
+    if (got < 0) {
+        fail_image(image_read_error, NULL);
+    }
+    assert_file_format((size_t)got == wanted);
+}
 
-    BmpHeader *old_header = (BmpHeader *)old_bmp.header;
+// Open an image for reading, it is closed if the image fails
+int open_image(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    check_fd(fd, filename);
+    image_fd = fd;
+    return fd;
+}
 
-    // Copy struct
-    Bmp new_bmp = old_bmp;
-    new_bmp.header = NULL;
-    new_bmp.pixels = NULL;
+void close_image(int fd) {
+    image_fd = -1;
+    close(fd);
+}
 
-    // Copy header
-    BmpHeader *header = malloc(sizeof(BmpHeader));
-    assert_copy(header != NULL);
-    memcpy(header, old_header, sizeof(BmpHeader));
-    new_bmp.header = header;
-    header->raw = NULL;
+void free_image_file(uint8_t *data) {
+    image_file = NULL;
+    image_free(data);
+}
 
-    // Copy raw header
-    header->raw = malloc(sizeof(unsigned char) * old_header->pixel_array_offset);
-    assert_copy(header->raw != NULL);
-    memcpy(header->raw, old_header->raw, old_header->pixel_array_offset);
+// Decision trace, see trace.h. Every thread records from its first event
+// on; the rings are only written out once trace_start gives a file to dump
+// to (-T)
+char *trace_path;
 
-    // Copy rest of image
-    new_bmp.pixels = calloc(header->height, sizeof(unsigned char **));
-    assert_copy(new_bmp.pixels != NULL);
-    for (int i = 0; i < header->height; i++) {
-        new_bmp.pixels[i] = calloc(header->width, sizeof(unsigned char *));
-        assert_copy(new_bmp.pixels[i] != NULL);
+typedef struct {
+    // Events recorded, the ring holds the last TRACE_EVENTS of them
+    uint64_t head;
 
-        for (int j = 0; j < header->width; j++) {
-            new_bmp.pixels[i][j] = malloc(3 * sizeof(unsigned char)); 
-            assert_copy(new_bmp.pixels[i][j] != NULL);
-            memcpy(new_bmp.pixels[i][j], old_bmp.pixels[i][j], 3 * sizeof(unsigned char));
-        }
-    }
+    // Event that started the image being decoded
+    uint64_t image_start;
 
-    return new_bmp;
+    // Ring number; when its thread exits the ring passes to a new one,
+    // once nothing holds it either, see trace_hold
+    uint32_t thread;
+    int in_use;
+    TraceEvent events[TRACE_EVENTS];
+} TraceRing;
+
+#define TRACE_MAX_RINGS 256
+
+TraceRing *trace_rings[TRACE_MAX_RINGS];
+int trace_ring_count;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t trace_key;
+pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+// The calling thread's ring, NULL until it first records
+__thread TraceRing *trace_ring;
+__thread bool trace_no_ring;
+
+void trace_release(void *ring) {
+    __atomic_sub_fetch(&((TraceRing *)ring)->in_use, 1, __ATOMIC_RELEASE);
 }
 
-void free_bmp(Bmp bmp) {
+// Rings of the band threads of the image this thread is decoding, and
+// where each band starts, held so they can't pass to a new thread before
+// a failure dump writes them out with this thread's ring
+__thread TraceRing *trace_held[TRACE_MAX_RINGS];
+__thread uint64_t trace_held_start[TRACE_MAX_RINGS];
+__thread int trace_held_count;
 
-    BmpHeader *header = (BmpHeader *)bmp.header;
+// Keep the calling thread's ring after the thread exits, until the thread
+// it is handed to with trace_adopt lets it go
+TraceRing *trace_hold(void) {
+    if(trace_ring != NULL){
+        __atomic_add_fetch(&trace_ring->in_use, 1, __ATOMIC_ACQUIRE);
+    }
+    return trace_ring;
+}
 
-    // Free each row
-    for (int i = 0; i < header->height; i++) {
+void trace_adopt(TraceRing *ring, uint64_t start) {
+    if(ring == NULL){
+        return;
+    }
+    if(trace_held_count == TRACE_MAX_RINGS){
+        trace_release(ring);
+        return;
+    }
+    trace_held[trace_held_count] = ring;
+    trace_held_start[trace_held_count++] = start;
+}
+
+void trace_create_key(void) {
+    pthread_key_create(&trace_key, trace_release);
+}
 
-        // Free each pixel
-        for (int j = 0; j < header->width; j++) {
-            free(bmp.pixels[i][j]); 
-            bmp.pixels[i][j] = NULL;
+// Give the calling thread a ring, one left by a thread that has exited if
+// there is one. Threads past TRACE_MAX_RINGS go untraced
+TraceRing *trace_attach(void) {
+    pthread_once(&trace_key_once, trace_create_key);
+    pthread_mutex_lock(&trace_lock);
+    for(int i = 0; i < trace_ring_count && trace_ring == NULL; i++){
+        if(__atomic_load_n(&trace_rings[i]->in_use, __ATOMIC_ACQUIRE) == 0){
+            trace_ring = trace_rings[i];
         }
-        free(bmp.pixels[i]);
-        bmp.pixels[i] = NULL;
     }
-    free(bmp.pixels); 
-    bmp.pixels = NULL;
-
-    // Free raw header
-    if (header != NULL) {
-        free(header->raw);
-        header->raw = NULL;
-        free(header);
+    if(trace_ring == NULL && trace_ring_count < TRACE_MAX_RINGS){
+        trace_ring = calloc(1, sizeof(TraceRing));
+        if(trace_ring != NULL){
+            trace_ring->thread = trace_ring_count;
+            trace_rings[trace_ring_count] = trace_ring;
+            __atomic_store_n(&trace_ring_count, trace_ring_count + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if(trace_ring != NULL){
+        __atomic_store_n(&trace_ring->in_use, 1, __ATOMIC_RELEASE);
+        pthread_setspecific(trace_key, trace_ring);
+    }else{
+        trace_no_ring = true;
     }
+    pthread_mutex_unlock(&trace_lock);
+    return trace_ring;
 }
 
-int bin_to_dec(int bin[]){
-    return (int)(bin[1]*pow(2,3) + bin[2]*pow(2, 2) + bin[4]*pow(2, 1) + bin[5]*pow(2, 0))%10;
+// Record an event, a few stores into the thread's ring
+static inline void trace(int type, int frame, uint32_t row, uint32_t value) {
+    if(trace_no_ring){
+        return;
+    }
+    TraceRing *ring = trace_ring != NULL ? trace_ring : trace_attach();
+    if(ring == NULL){
+        return;
+    }
+    TraceEvent *event = &ring->events[ring->head & (TRACE_EVENTS - 1)];
+    event->sequence = (uint32_t)ring->head;
+    event->type = type;
+    event->frame = frame;
+    event->reserved = 0;
+    event->row = row;
+    event->value = value;
+    ring->head++;
 }
 
-bool is_valid_parity(int bin[]){
-    return (bin[1] + bin[2])%2 == bin[3] && (bin[4] + bin[5])%2 == bin[6];
+// Record the start of an image, a failure dump goes back to here
+// The band rings held for the last image are let go
+void trace_image(uint32_t scanlines, uint32_t index) {
+    while(trace_held_count > 0){
+        trace_release(trace_held[--trace_held_count]);
+    }
+    trace(TRACE_IMAGE, 0, scanlines, index);
+    if(trace_ring != NULL){
+        trace_ring->image_start = trace_ring->head - 1;
+    }
 }
 
-bool is_reversed(Bmp bmp){
-    // If the color of the fourth bit is black, the barcode is reverse
-    return bmp.pixels[0][3][0] == 0;
+// Write all of a buffer, false if the write fails
+bool trace_write(int fd, const void *buf, size_t n) {
+    while(n > 0){
+        ssize_t written = write(fd, buf, n);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){
+            return false;
+        }
+        buf = (const uint8_t *)buf + written;
+        n -= written;
+    }
+    return true;
 }
 
-// RGB(0,0,0) = black;
-// 0 -> black
-// black -> 1
+// Write a ring's events from event first on, or as many as it still holds
+bool trace_write_ring(int fd, const TraceRing *ring, uint64_t first) {
+    uint64_t head = ring->head;
+    first = head - first > TRACE_EVENTS ? head - TRACE_EVENTS : first;
+    size_t start = first & (TRACE_EVENTS - 1);
+    size_t count = head - first;
+    size_t before_wrap = count < TRACE_EVENTS - start ? count : TRACE_EVENTS - start;
+    TraceRingHeader header = {ring->thread, count};
+    return trace_write(fd, &header, sizeof(header))
+        && trace_write(fd, &ring->events[start], sizeof(TraceEvent) * before_wrap)
+        && trace_write(fd, ring->events, sizeof(TraceEvent) * (count - before_wrap));
+}
 
-void get_data_frame(int data_frame[][DFRow][DFCol], Bmp bmp){
-    int temp_frame[bmp.height][DFRow*DFCol];
-    if(!is_reversed(bmp)){
-        for(int i = 0; i < bmp.height; i++){
-            for(int j = 0; j < DFRow*DFCol; j++){
-                temp_frame[i][j] = bmp.pixels[i][j + 3][0] == 0 ? 1 : 0;
-            }
+// Append a dump to the trace file: the calling thread's events since the
+// start of a failed image, and those of the bands it held, or every ring
+// for a signal
+// Only open, write and close are used so a signal handler can call it
+void trace_dump(uint32_t reason, int signal_number, const char *name) {
+    int fd = open(trace_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if(fd < 0){
+        return;
+    }
+    int rings = __atomic_load_n(&trace_ring_count, __ATOMIC_ACQUIRE);
+    TraceDumpHeader header = {TRACE_MAGIC, reason, signal_number, 0, strlen(name)};
+    header.rings = reason == TRACE_DUMP_SIGNAL ? rings : (trace_ring != NULL) + trace_held_count;
+    bool ok = trace_write(fd, &header, sizeof(header)) && trace_write(fd, name, header.name_length);
+    if(reason == TRACE_DUMP_SIGNAL){
+        for(int i = 0; i < rings && ok; i++){
+            ok = trace_write_ring(fd, trace_rings[i], 0);
         }
     }else{
-        for(int i = 0; i < bmp.height; i++){
-            for(int j = 0; j < DFRow*DFCol; j++){
-                temp_frame[i][DFRow*DFCol - 1 - j] = bmp.pixels[i][j + 3][0] == 0 ? 1 : 0;
-            }
+        if(trace_ring != NULL && ok){
+            ok = trace_write_ring(fd, trace_ring, trace_ring->image_start);
+        }
+        for(int i = 0; i < trace_held_count && ok; i++){
+            ok = trace_write_ring(fd, trace_held[i], trace_held_start[i]);
         }
     }
+    close(fd);
+}
 
-    for(int i = 0; i < bmp.height; i++){
-        for(int j = 0; j < DFRow; j++) {
-            for(int k = 0; k < DFCol; k++) {
-                data_frame[i][j][k] = temp_frame[i][j*DFCol + k];
-            }
-        }
+// Dumps are written one at a time. A signal handler can't wait on
+// trace_lock, so every dump also spins for this flag; a thread already in
+// a dump when a crash signal arrives skips the signal's dump rather than
+// wait on itself
+int trace_dumping;
+__thread volatile bool trace_in_dump;
+
+bool trace_begin_dump(void) {
+    if(trace_in_dump){
+        return false;
     }
+    trace_in_dump = true;
+    while(__atomic_exchange_n(&trace_dumping, 1, __ATOMIC_ACQUIRE)){
+    }
+    return true;
 }
 
-int get_valid_row(int check_parity[][DFRow], int height){
-    for(int i = 0; i < height; i++) {
-        int sum = 0;
-        for(int j = 0; j < DFRow; j++) {
-            sum += check_parity[i][j];
-        }
-        // If there is no parity error, sum will be equal to DFRow
-        if(sum == DFRow) {
-            return i;
-        }
+void trace_end_dump(void) {
+    __atomic_store_n(&trace_dumping, 0, __ATOMIC_RELEASE);
+    trace_in_dump = false;
+}
+
+// Dump the trace of an image that could not be read
+// SIGUSR1 is held off meanwhile, so its dump follows this one instead of
+// being skipped
+void trace_failure(const char *name) {
+    if(trace_path == NULL){
+        return;
+    }
+    sigset_t usr1, old_mask;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_mutex_lock(&trace_lock);
+    pthread_sigmask(SIG_BLOCK, &usr1, &old_mask);
+    if(trace_begin_dump()){
+        trace_dump(TRACE_DUMP_FAILURE, 0, name);
+        trace_end_dump();
     }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_mutex_unlock(&trace_lock);
+}
 
-    // If there is no valid row, return -1;
-    return -1;
+// SIGUSR1 dumps every ring and carries on, a crash dumps them and then
+// goes on to end the process as it would have
+void trace_signal(int signal_number) {
+    if(trace_begin_dump()){
+        trace_dump(TRACE_DUMP_SIGNAL, signal_number, "");
+        trace_end_dump();
+    }
+    if(signal_number != SIGUSR1){
+        raise(signal_number);
+    }
 }
 
-void get_invalid_frame(int invalid_frame[DFRow], int check_parity[][DFRow], int height){
-    for(int i = 0; i < DFRow; i++){
-        int sum = 0;
-        for(int j = 0; j < height; j++){
-            sum += check_parity[j][i];
-        }
-        if(sum == 0) {
-            invalid_frame[i] = 1;
-        }else{
-            invalid_frame[i] = 0;
-        }
+void trace_start(char *path) {
+    trace_path = path;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    int crashes[] = {SIGSEGV, SIGBUS, SIGFPE, SIGABRT};
+    action.sa_flags = SA_RESETHAND;
+    for(int i = 0; i < 4; i++){
+        sigaction(crashes[i], &action, NULL);
     }
 }
 
-int main(int argc, char** argv){
-    char *filename = argv[1];
-    if(filename == NULL){
-        printf("No bmp image filename provided.\n");
-        return 0;
+// Fill in header from the first BMP_HEADER_SIZE bytes of a file
+// Returns false if the file is not a 24 bit windows bitmap
+bool parse_bmp_header(const uint8_t standard_header[], BmpHeader *header) {
+
+    // Check file type
+    if (standard_header[0] != 'B' || standard_header[1] != 'M') {
+        return false;
     }
-    char *flag = argv[argc - 1];
-    Bmp bmp = read_bmp(filename);
 
-    // Check flag
-    if(strcmp(flag, "-d") == 0){
-        printf("Read file %s\n", filename);
-        printf("Width: %d\n", bmp.width);
-        printf("Height: %d\n", bmp.height);
-        return 0;
+    header->file_size = *((uint32_t *)(standard_header + SIZE_OFFSET));
+    header->pixel_array_offset =  *((uint32_t *)(standard_header + PIXEL_ARRAY_OFFSET));
+
+    header->pixel_size = *((uint16_t *)(standard_header + PIXEL_SIZE_OFFSET));
+    if (header->pixel_size != 24) {
+        return false;
     }
 
-    // Get DataFrame
-    int data_frame[bmp.height][DFRow][DFCol];
-    get_data_frame(data_frame, bmp);
+    header->width =  *((uint32_t *)(standard_header + WIDTH_OFFSET));
+    header->height =  *((uint32_t *)(standard_header + HEIGHT_OFFSET));
+
+    uint64_t row_size = ((uint64_t)header->pixel_size * header->width + 31) / 32 * 4;
+    if (row_size > UINT32_MAX) {
+        return false;
+    }
+    header->row_size = row_size;
+
+    #ifdef DEBUG
+    printf("Row size %u\n",header->row_size);
+    #endif
+
+    header->data_size = *((uint32_t *)(standard_header + DATA_SIZE_OFFSET));
+    header->raw = NULL;
+    header->row_store = NULL;
 
-    int check_parity[bmp.height][DFRow];
+    // Sizes are checked in 64 bits so a lying header can't wrap around,
+    // and the rows have to fit in the pixel array it claims
+    return (uint64_t)header->data_size + header->pixel_array_offset == header->file_size
+        && header->pixel_array_offset >= BMP_HEADER_SIZE
+        && (uint64_t)header->row_size * header->height <= header->data_size;
+}
 
-    for(int i = 0; i < bmp.height; i++){
-        for(int j = 0; j < DFRow; j++){
-            check_parity[i][j] = is_valid_parity(data_frame[i][j]);
+// Read up to n bytes, retrying on short reads (pipes, terminals, signals)
+// Returns the number of bytes read, which is only less than n at end of file
+size_t read_full(int fd, void *buf, size_t n) {
+    size_t total = 0;
+    while (total < n) {
+        ssize_t got = read(fd, (uint8_t *)buf + total, n - total);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
         }
+        total += got;
+    }
+    return total;
+}
+
+// Read and validate only the standard header of an already opened file
+// The pixel array is never touched, so this costs one read and one fstat
+bool read_bmp_header_fd(int fd, BmpHeader *header) {
+    uint8_t standard_header[BMP_HEADER_SIZE];
+    if (read_full(fd, standard_header, BMP_HEADER_SIZE) != BMP_HEADER_SIZE) {
+        return false;
+    }
+    if (!parse_bmp_header(standard_header, header)) {
+        return false;
     }
 
-    int valid_row = get_valid_row(check_parity, bmp.height);
+    // The pixel array has to actually be there, pipes can't be checked up front
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    return !S_ISREG(st.st_mode) || st.st_size >= header->file_size;
+}
 
-    // If there are no valid row, show all the error columns
-    if(valid_row == -1){
-        int invalid_frame[DFRow];
-        get_invalid_frame(invalid_frame, check_parity, bmp.height);
-        int count_invalid = 0;
-        int list_invalid[DFRow];
-        for(int i = 0; i < DFRow; i++){
-            if(invalid_frame[i] == 1){
-                list_invalid[count_invalid] = i;
-                count_invalid ++;
-            }
-        }
-        if(count_invalid == 1){
-            printf("Unable to read frame: %d\n", list_invalid[0]);
-        }else{
-            printf("Unable to read frames: ");
-            for(int i = 0; i < count_invalid - 1; i++){
-                printf("%d ", list_invalid[i]);
-            }
-            printf("%d\n", list_invalid[count_invalid - 1]);
-        }
+// Read only the header of an image, "-" reads from stdin
+BmpHeader read_bmp_header(char *filename) {
+    bool from_stdin = strcmp(filename, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open_image(filename);
 
-        return 0;
+    BmpHeader header;
+    assert_file_format(read_bmp_header_fd(fd, &header));
+    if (!from_stdin) {
+        close_image(fd);
     }
 
-    // If there is no parity error, show the decoded barcode
-    for(int i = 0; i + 1 < DFRow; i++) 
-    {
-        printf("%d ", bin_to_dec(data_frame[valid_row][i]));
-    }   
-    printf("%d\n", bin_to_dec(data_frame[valid_row][DFRow - 1]));
+    return header;
+}
+
+// Change the size of an image header, keeping the raw header in step
+// so the image can still be written out
+void set_bmp_dimensions(BmpHeader *header, unsigned int height, unsigned int width) {
+    header->height = height;
+    header->width = width;
+    header->row_size = ((header->pixel_size * width + 31) / 32) * 4;
+    header->data_size = header->row_size * height;
+    header->file_size = header->pixel_array_offset + header->data_size;
+
+    *((uint32_t *)(header->raw + SIZE_OFFSET)) = header->file_size;
+    *((uint32_t *)(header->raw + WIDTH_OFFSET)) = width;
+    *((uint32_t *)(header->raw + HEIGHT_OFFSET)) = height;
+    *((uint32_t *)(header->raw + DATA_SIZE_OFFSET)) = header->data_size;
+}
+
+PixelStore *new_pixel_store(unsigned int height, unsigned int width) {
+    PixelStore *store = malloc(sizeof(PixelStore));
+    assert_file_format(store != NULL);
+    store->refs = 0;
+    store->height = height;
+    store->width = width;
+
+    // One allocation for all pixels instead of one per pixel
+    store->row_refs = calloc(height, sizeof(int));
+    store->row_pixels = image_alloc((size_t)height * width * sizeof(unsigned char *));
+    store->data = image_alloc((size_t)height * width * 3);
+    if (height != 0 && width != 0 && (store->row_refs == NULL || store->row_pixels == NULL || store->data == NULL)) {
+        free(store->row_refs);
+        image_free(store->row_pixels);
+        image_free(store->data);
+        free(store);
+        assert_file_format(false);
+    }
+
+    for (size_t i = 0; i < (size_t)height * width; i++) {
+        store->row_pixels[i] = store->data + 3 * i;
+    }
+
+    return store;
+}
+
+// Index of the store row that an image row points into
+unsigned int store_row(PixelStore *store, unsigned char **row) {
+    if (store->width == 0) {
+        return 0;
+    }
+    return (row - store->row_pixels) / store->width;
+}
+
+// Add a reference from an image row to the store row it points into
+void share_row(PixelStore *store, unsigned char **row) {
+    store->refs++;
+    store->row_refs[store_row(store, row)]++;
+}
+
+// Drop a reference, the store is freed once no image row points into it
+void release_row(PixelStore *store, unsigned char **row) {
+    store->row_refs[store_row(store, row)]--;
+    if (--store->refs == 0) {
+        free(store->row_refs);
+        image_free(store->row_pixels);
+        image_free(store->data);
+        free(store);
+    }
+}
+
+// Allocate the pixel grid and fill it from a raw pixel array
+void load_pixels(Bmp *bmp, const uint8_t *raw_image) {
+    BmpHeader *header = bmp->header;
+
+    // Allocate columns, rows not yet given a store are left NULL so
+    // free_bmp can drop an image that fails part way
+    bmp->pixels = malloc(header->height * sizeof(unsigned char **));
+    header->row_store = calloc(header->height, sizeof(PixelStore *));
+    assert_file_format(header->height == 0 || (bmp->pixels != NULL && header->row_store != NULL));
+    PixelStore *store = new_pixel_store(header->height, header->width);
+    for (int i = 0; i < header->height; i++) {
+
+        // Rows point into the shared store
+        bmp->pixels[i] = store->row_pixels + (size_t)i * header->width;
+        header->row_store[i] = store;
+        share_row(store, bmp->pixels[i]);
+    }
+
+    // Read in each pixel
+    for (int y = 0; y < header->height; y++) {
+        const uint8_t *raw_row = raw_image + (size_t)y * header->row_size;
+        for (int x = 0; x < header->width; x++) {
+            
+            // Read in each pixel
+            bmp->pixels[y][x][BLUE] = raw_row[header->pixel_size/8 * x + 0];
+            bmp->pixels[y][x][GREEN] = raw_row[header->pixel_size/8 * x + 1];
+            bmp->pixels[y][x][RED] = raw_row[header->pixel_size/8 * x + 2];
+        }
+    }
+
+    // Write height and width inside output bmp wrapper
+    bmp->height = header->height;
+    bmp->width = header->width;
+}
+
+// Open an image from a buffer holding the whole file
+Bmp read_bmp_mem(const void *buf, size_t len) {
+    const uint8_t *data = buf;
+
+    // Struct to return results, freed if the image fails
+    Bmp bmp = {0};
+    image_bmp = &bmp;
+    bmp.header = calloc(1, sizeof(BmpHeader));
+    BmpHeader *header = bmp.header;
+    assert_file_format(header != NULL);
+
+    // Read in standard header
+    assert_file_format(len >= BMP_HEADER_SIZE);
+    assert_file_format(parse_bmp_header(data, header));
+    assert_file_format(len >= header->file_size);
+
+    // Copy entire header (everything but pixel array)
+    header->raw = malloc(sizeof(unsigned char) * header->pixel_array_offset);
+    assert_file_format(header->raw != NULL);
+    memcpy(header->raw, data, header->pixel_array_offset);
+
+    load_pixels(&bmp, data + header->pixel_array_offset);
+    image_bmp = NULL;
+
+    return bmp;
+}
+
+// Read a whole image from a pipe or other stream that can't be rewound
+Bmp read_bmp_fd(int fd) {
+    uint8_t standard_header[BMP_HEADER_SIZE];
+    assert_file_format(read_full(fd, standard_header, BMP_HEADER_SIZE) == BMP_HEADER_SIZE);
+
+    BmpHeader header;
+    assert_file_format(parse_bmp_header(standard_header, &header));
+
+    // The header tells us exactly how much is left to read
+    uint8_t *data = image_alloc(header.file_size);
+    assert_file_format(data != NULL);
+    image_file = data;
+    memcpy(data, standard_header, BMP_HEADER_SIZE);
+    size_t rest = header.file_size - BMP_HEADER_SIZE;
+    assert_file_format(read_full(fd, data + BMP_HEADER_SIZE, rest) == rest);
+
+    Bmp bmp = read_bmp_mem(data, header.file_size);
+    free_image_file(data);
+
+    return bmp;
+}
+
+Bmp read_bmp(char *filename) {
+
+    // "-" reads the image from stdin
+    if (strcmp(filename, "-") == 0) {
+        return read_bmp_fd(STDIN_FILENO);
+    }
+
+    FILE *fp = fopen(filename, "r");
+    check_fp(fp, filename);
+    image_fp = fp;
+
+    // Read in standard header
+    uint8_t standard_header[BMP_HEADER_SIZE];
+    BmpHeader parsed;
+    size_t bytes_read = fread(standard_header, 1, BMP_HEADER_SIZE, fp);
+    check_read(ferror(fp) ? -1 : bytes_read, BMP_HEADER_SIZE);
+    assert_file_format(parse_bmp_header(standard_header, &parsed));
+
+    // Struct to return results, freed if the image fails
+    Bmp bmp = {0};
+    image_bmp = &bmp;
+    bmp.header = malloc(sizeof(BmpHeader));
+    assert_file_format(bmp.header != NULL);
+    BmpHeader *header = bmp.header;
+    *header = parsed;
+
+    // Read in entire header (everything but pixel array)
+    rewind(fp);
+    header->raw = malloc(sizeof(unsigned char) * header->pixel_array_offset);
+    assert_file_format(header->raw != NULL);
+    bytes_read = fread(header->raw, 1, header->pixel_array_offset, fp);
+
+    // Read in rest of file
+    uint8_t *raw_image = image_alloc(header->data_size);
+    assert_file_format(raw_image != NULL);
+    image_file = raw_image;
+    bytes_read = fread(raw_image, 1, header->data_size, fp);
+    check_read(ferror(fp) ? -1 : bytes_read, header->data_size);
+
+    load_pixels(&bmp, raw_image);
+
+    free_image_file(raw_image);
+    image_bmp = NULL;
+    image_fp = NULL;
+    fclose(fp);
+
+    return bmp;
+}
+
+// Read only rows [row, row + height) and columns [col, col + width) of an image
+// Ranges are clipped to the image. Each row is fetched with pread at its
+// row_size stride, so columns outside the range are never read from disk
+Bmp read_bmp_roi(char *filename, unsigned int row, unsigned int height, unsigned int col, unsigned int width) {
+
+    int fd = open_image(filename);
+
+    // Struct to return results, freed if the image fails
+    Bmp bmp = {0};
+    image_bmp = &bmp;
+    bmp.header = calloc(1, sizeof(BmpHeader));
+    BmpHeader *header = bmp.header;
+    assert_file_format(header != NULL);
+    assert_file_format(read_bmp_header_fd(fd, header));
+
+    // Read in entire header (everything but pixel array)
+    header->raw = malloc(sizeof(unsigned char) * header->pixel_array_offset);
+    assert_file_format(header->raw != NULL);
+    check_read(pread(fd, header->raw, header->pixel_array_offset, 0), header->pixel_array_offset);
+
+    // Clip the region to the image
+    uint32_t image_row_size = header->row_size;
+    row = row < header->height ? row : header->height;
+    col = col < header->width ? col : header->width;
+    height = height < header->height - row ? height : header->height - row;
+    width = width < header->width - col ? width : header->width - col;
+    set_bmp_dimensions(header, height, width);
+
+    size_t span = (size_t)width * 3;
+    off_t first = (off_t)header->pixel_array_offset + (off_t)row * image_row_size + col * 3;
+    uint8_t *raw_image = image_alloc(header->data_size);
+    assert_file_format(raw_image != NULL);
+    image_file = raw_image;
+
+    if (image_row_size - span >= ROI_SKIP_BYTES) {
+
+        // Wide image, fetch just the region of each row
+        for (int y = 0; y < height; y++) {
+            ssize_t got = pread(fd, raw_image + (size_t)y * header->row_size, span, first + (off_t)y * image_row_size);
+            check_read(got, span);
+        }
+    } else {
+
+        // Small gaps, read whole rows a chunk at a time and keep the region
+        size_t chunk_rows = ROI_CHUNK_BYTES / image_row_size + 1;
+        uint8_t *chunk = malloc(chunk_rows * image_row_size);
+        assert_file_format(chunk != NULL);
+        for (int y = 0; y < height; y += chunk_rows) {
+            size_t rows = height - y < chunk_rows ? height - y : chunk_rows;
+            size_t bytes = (rows - 1) * image_row_size + span;
+            ssize_t got = pread(fd, chunk, bytes, first + (off_t)y * image_row_size);
+            if (got != bytes) {
+                free(chunk);
+                check_read(got, bytes);
+            }
+            for (int i = 0; i < rows; i++) {
+                memcpy(raw_image + (size_t)(y + i) * header->row_size, chunk + (size_t)i * image_row_size, span);
+            }
+        }
+        free(chunk);
+    }
+    close_image(fd);
+
+    load_pixels(&bmp, raw_image);
+    free_image_file(raw_image);
+    image_bmp = NULL;
+
+    return bmp;
+}
+
+void assert_write(bool condition) {
+    if (!condition) {
+        fprintf(stderr, "file write error\n");
+        exit(1);
+    }
+}
+
+void write_bmp(Bmp bmp, char *filename) {
+
+    FILE *fp = fopen(filename, "w");
+    check_fp(fp, filename);
+
+    BmpHeader *header = (BmpHeader *)bmp.header;
+
+    // Write entire header (everything but pixel array)
+    size_t bytes_written = fwrite(header->raw, 1, header->pixel_array_offset, fp);
+    assert_write(bytes_written == header->pixel_array_offset);
+
+    // Write rest of file
+    // Loop backward through rows (image indexed from bottom left
+    for (int y = 0; y < header->height; y++) {
+        for (int x = 0; x < header->width; x++) {
+
+            unsigned char *pixel = bmp.pixels[y][x];
+            fwrite(&pixel[BLUE], 1, 1, fp);
+            fwrite(&pixel[GREEN], 1, 1, fp);
+            fwrite(&pixel[RED], 1, 1, fp);
+        }
+
+        // Write padding
+        if ((header->width * 3) % 4 != 0) {
+            char null_byte = 0x00;
+            for (int i = 0; i < 4 - (header->width * 3) % 4; i++) {
+                fwrite(&null_byte, 1, 1, fp);
+            }
+        }
+    }
+
+    fclose(fp);
+}
+
+void assert_copy(bool condition) {
+    if (!condition) {
+        fprintf(stderr, "file write error\n");
+        exit(1);
+    }
+}
+
+// Make a view of part of an image
+// No pixels are copied, the view shares rows with the image
+Bmp view_bmp(Bmp old_bmp, unsigned int row, unsigned int height, unsigned int col, unsigned int width) {
+
+    BmpHeader *old_header = (BmpHeader *)old_bmp.header;
+    // Compared against what is left past row and col, as row + height
+    // could wrap
+    assert_copy(row <= old_bmp.height && height <= old_bmp.height - row);
+    assert_copy(col <= old_bmp.width && width <= old_bmp.width - col);
+
+    // Copy struct
+    Bmp new_bmp = old_bmp;
+    new_bmp.header = NULL;
+    new_bmp.pixels = NULL;
+
+    // Copy header
+    BmpHeader *header = malloc(sizeof(BmpHeader));
+    assert_copy(header != NULL);
+    memcpy(header, old_header, sizeof(BmpHeader));
+    new_bmp.header = header;
+    header->raw = NULL;
+
+    // Copy raw header
+    header->raw = malloc(sizeof(unsigned char) * old_header->pixel_array_offset);
+    assert_copy(header->raw != NULL);
+    memcpy(header->raw, old_header->raw, old_header->pixel_array_offset);
+    if (height != old_bmp.height || width != old_bmp.width) {
+        set_bmp_dimensions(header, height, width);
+    }
+
+    // Point each row at the rows of the old image
+    new_bmp.pixels = calloc(height, sizeof(unsigned char **));
+    header->row_store = calloc(height, sizeof(PixelStore *));
+    assert_copy(height == 0 || (new_bmp.pixels != NULL && header->row_store != NULL));
+    for (int i = 0; i < height; i++) {
+        new_bmp.pixels[i] = old_bmp.pixels[row + i] + col;
+        header->row_store[i] = old_header->row_store[row + i];
+        share_row(header->row_store[i], new_bmp.pixels[i]);
+    }
+
+    new_bmp.height = height;
+    new_bmp.width = width;
+
+    return new_bmp;
+}
+
+// Copy a bmp image
+// The copy shares its pixels with the original until either one writes
+// to a row with bmp_row_for_write
+Bmp copy_bmp(Bmp old_bmp) {
+    return view_bmp(old_bmp, 0, old_bmp.height, 0, old_bmp.width);
+}
+
+// Get a row of an image for writing
+// If the row is shared with a copy or view it is copied first
+unsigned char **bmp_row_for_write(Bmp bmp, unsigned int row) {
+
+    BmpHeader *header = (BmpHeader *)bmp.header;
+    PixelStore *store = header->row_store[row];
+
+    if (store->row_refs[store_row(store, bmp.pixels[row])] > 1) {
+        PixelStore *copy = new_pixel_store(1, bmp.width);
+        for (int x = 0; x < bmp.width; x++) {
+            memcpy(copy->row_pixels[x], bmp.pixels[row][x], 3 * sizeof(unsigned char));
+        }
+
+        release_row(store, bmp.pixels[row]);
+        bmp.pixels[row] = copy->row_pixels;
+        header->row_store[row] = copy;
+        share_row(copy, bmp.pixels[row]);
+    }
+
+    return bmp.pixels[row];
+}
+
+void free_bmp(Bmp bmp) {
+
+    BmpHeader *header = (BmpHeader *)bmp.header;
+
+    // Release each row, pixels are freed with the last image using them
+    // An image that failed while loading has rows only up to the first
+    // without a store, or none
+    for (int i = 0; header != NULL && header->row_store != NULL && i < header->height && header->row_store[i] != NULL; i++) {
+        release_row(header->row_store[i], bmp.pixels[i]);
+        bmp.pixels[i] = NULL;
+    }
+    free(bmp.pixels); 
+    bmp.pixels = NULL;
+
+    // Free raw header
+    if (header != NULL) {
+        free(header->row_store);
+        header->row_store = NULL;
+        free(header->raw);
+        header->raw = NULL;
+        free(header);
+    }
+}
+
+// Frame value of the count bits starting at bit start of a packed row
+// Bit k of the value is column k of the frame
+static inline uint16_t extract_bits(const uint64_t *bits, int start, int count) {
+    int word = start / 64;
+    int shift = start % 64;
+    uint64_t value = bits[word] >> shift;
+    if (shift + count > 64) {
+        value |= bits[word + 1] << (64 - shift);
+    }
+    return value & ((1u << count) - 1);
+}
+
+// Split a packed row into frames and look up their parity
+// The wrappers below pass the geometry as constants, so the compiler
+// unrolls this into a dedicated loop for each common layout
+static inline void decode_row_kernel(const Symbology *sym, const uint64_t *bits, uint16_t *values, int *valid, int frames, int frame_bits) {
+    for (int f = 0; f < frames; f++) {
+        values[f] = extract_bits(bits, f * frame_bits, frame_bits);
+        valid[f] = sym->valid[values[f]];
+    }
+}
+
+void decode_row_8x8(const Symbology *sym, const uint64_t *bits, uint16_t *values, int *valid) {
+    decode_row_kernel(sym, bits, values, valid, 8, 8);
+}
+
+void decode_row_12x8(const Symbology *sym, const uint64_t *bits, uint16_t *values, int *valid) {
+    decode_row_kernel(sym, bits, values, valid, 12, 8);
+}
+
+void decode_row_16x8(const Symbology *sym, const uint64_t *bits, uint16_t *values, int *valid) {
+    decode_row_kernel(sym, bits, values, valid, 16, 8);
+}
+
+void decode_row_generic(const Symbology *sym, const uint64_t *bits, uint16_t *values, int *valid) {
+    decode_row_kernel(sym, bits, values, valid, sym->frames, sym->frame_bits);
+}
+
+// Frame layout of our labels: a white start bit, data bits 1, 2, 4 and 5,
+// parity bit 3 over bits 1 and 2, parity bit 6 over bits 4 and 5, and a
+// black stop bit. Data values of 10 and up wrap around to a single digit
+#define FRAME_LAYOUT \
+    .frame_bits = DFCol, .guard_left = GUARD_COLS, .guard_right = GUARD_COLS, \
+    .data_bit_count = 4, .data_bits = {1, 2, 4, 5}, \
+    .parity_count = 2, .parity_bits = {3, 6}, .parity_masks = {(1 << 1) | (1 << 2), (1 << 4) | (1 << 5)}, \
+    .digits = "0123456789012345"
+
+Symbology symbologies[] = {
+    {.name = "12", .frames = DFRow, FRAME_LAYOUT},
+    {.name = "8", .frames = 8, FRAME_LAYOUT},
+    {.name = "16", .frames = 16, FRAME_LAYOUT},
+};
+
+#define SYMBOLOGY_COUNT (sizeof(symbologies) / sizeof(symbologies[0]))
+
+// Build the lookup tables of a symbology and pick its row kernel
+void init_symbology(Symbology *sym) {
+    if (sym->valid != NULL) {
+        return;
+    }
+
+    uint32_t values = 1u << sym->frame_bits;
+    sym->valid = malloc(values);
+    sym->digit = malloc(values);
+    assert_file_format(sym->valid != NULL && sym->digit != NULL);
+
+    for (uint32_t v = 0; v < values; v++) {
+        int data = 0;
+        for (int i = 0; i < sym->data_bit_count; i++) {
+            data = data * 2 + ((v >> sym->data_bits[i]) & 1);
+        }
+        sym->digit[v] = sym->digits[data];
+
+        sym->valid[v] = 1;
+        for (int i = 0; i < sym->parity_count; i++) {
+            int ones = 0;
+            for (int bit = 0; bit < sym->frame_bits; bit++) {
+                ones += (sym->parity_masks[i] >> bit) & (v >> bit) & 1;
+            }
+            if (ones % 2 != ((v >> sym->parity_bits[i]) & 1)) {
+                sym->valid[v] = 0;
+            }
+        }
+    }
+
+    if (sym->frame_bits == 8 && sym->frames == 8) {
+        sym->decode_row = decode_row_8x8;
+    } else if (sym->frame_bits == 8 && sym->frames == 12) {
+        sym->decode_row = decode_row_12x8;
+    } else if (sym->frame_bits == 8 && sym->frames == 16) {
+        sym->decode_row = decode_row_16x8;
+    } else {
+        sym->decode_row = decode_row_generic;
+    }
+}
+
+// Find a symbology by name, NULL if there is none
+Symbology *find_symbology(char *name) {
+    for (int i = 0; i < SYMBOLOGY_COUNT; i++) {
+        if (strcmp(symbologies[i].name, name) == 0) {
+            init_symbology(&symbologies[i]);
+            return &symbologies[i];
+        }
+    }
+    return NULL;
+}
+
+// Pick the symbology whose full width (guards included) matches the image,
+// or its height for barcodes turned on their side
+// Images of any other size are read with the standard layout
+Symbology *symbology_for_size(unsigned int width, unsigned int height) {
+    Symbology *sym = &symbologies[0];
+    for (int i = 0; i < SYMBOLOGY_COUNT; i++) {
+        if (symbologies[i].guard_left + symbologies[i].frames * symbologies[i].frame_bits + symbologies[i].guard_right == width) {
+            sym = &symbologies[i];
+            break;
+        }
+    }
+    for (int i = 0; sym == &symbologies[0] && i < SYMBOLOGY_COUNT; i++) {
+        if (symbologies[i].guard_left + symbologies[i].frames * symbologies[i].frame_bits + symbologies[i].guard_right == height) {
+            sym = &symbologies[i];
+        }
+    }
+    init_symbology(sym);
+    return sym;
+}
+
+// Scanlines packed per block when reading a barcode on its side
+// A block of packed rows stays in L1 while the image rows stream past
+#define TRANSPOSE_BLOCK 64
+
+// Pixels converted to luminance at a time when building histograms
+#define HISTOGRAM_BLOCK 64
+
+// Which way round the barcode is in the image
+typedef enum {
+    // Read along image rows, left to right or right to left
+    ORIENT_NORMAL,
+    ORIENT_REVERSED,
+
+    // Turned 90 or 270 degrees, read along image columns
+    ORIENT_VERTICAL,
+    ORIENT_VERTICAL_REVERSED
+} Orientation;
+
+// How pixels are turned into bits
+typedef enum {
+    // Only RGB(0,0,0) is black, as the labels are printed
+    THRESHOLD_FIXED,
+
+    // One Otsu threshold on luminance over the whole barcode
+    THRESHOLD_OTSU,
+
+    // An Otsu threshold per image row, for uneven lighting
+    THRESHOLD_LOCAL
+} ThresholdMode;
+
+typedef struct {
+    ThresholdMode mode;
+
+    // Pixels darker than the level of their image row are black
+    // NULL for THRESHOLD_FIXED
+    uint8_t *levels;
+} Threshold;
+
+// Luminance of a pixel, 0 to 255
+static inline int luminance(const unsigned char *pixel) {
+    return (77 * pixel[RED] + 150 * pixel[GREEN] + 29 * pixel[BLUE]) >> 8;
+}
+
+// RGB(0,0,0) = black;
+// 0 -> black
+// black -> 1
+static inline uint64_t is_black(const Threshold *threshold, const unsigned char *pixel, int row) {
+    if (threshold->mode == THRESHOLD_FIXED) {
+        return pixel[RED] == 0;
+    }
+    return luminance(pixel) < threshold->levels[row];
+}
+
+// Otsu's method: the level that best splits a histogram into two classes
+// Returns -1 if the histogram has no second class to split off
+int otsu_level(const uint32_t histogram[256]) {
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    for (int i = 0; i < 256; i++) {
+        total += histogram[i];
+        sum += (uint64_t)i * histogram[i];
+    }
+
+    uint64_t dark = 0;
+    uint64_t dark_sum = 0;
+    double best = 0;
+    int level = -1;
+    for (int t = 0; t < 255; t++) {
+        dark += histogram[t];
+        dark_sum += (uint64_t)t * histogram[t];
+        if (dark == 0 || dark == total) {
+            continue;
+        }
+
+        // Between class variance, up to a constant factor
+        double light = total - dark;
+        double diff = (double)dark_sum / dark - (double)(sum - dark_sum) / light;
+        double variance = (double)dark * light * diff * diff;
+        if (variance > best) {
+            best = variance;
+            level = t + 1;
+        }
+    }
+    return level;
+}
+
+// Luminance histogram of one image row
+// Pixels of a row are contiguous, so the luminance loop vectorises; the
+// counts go into four interleaved histograms so back to back pixels of
+// the same colour don't wait on each other
+void row_histogram(const unsigned char *row, int width, uint32_t histogram[256]) {
+    uint8_t luma[HISTOGRAM_BLOCK];
+    uint32_t lanes[4][256];
+    memset(lanes, 0, sizeof(lanes));
+
+    for (int x0 = 0; x0 < width; x0 += HISTOGRAM_BLOCK) {
+        int n = width - x0 < HISTOGRAM_BLOCK ? width - x0 : HISTOGRAM_BLOCK;
+        const unsigned char *pixel = row + 3 * x0;
+        for (int x = 0; x < n; x++) {
+            luma[x] = (77 * pixel[3 * x + RED] + 150 * pixel[3 * x + GREEN] + 29 * pixel[3 * x + BLUE]) >> 8;
+        }
+        for (int x = 0; x < n; x++) {
+            lanes[x & 3][luma[x]]++;
+        }
+    }
+
+    for (int i = 0; i < 256; i++) {
+        histogram[i] = lanes[0][i] + lanes[1][i] + lanes[2][i] + lanes[3][i];
+    }
+}
+
+// Pick the threshold levels for an image in one pass over its pixels
+// The image is expected to be just the barcode region (see read_bmp_roi)
+// Fill in the level of each row, for the modes that have levels
+void fill_threshold_levels(ThresholdMode mode, Bmp bmp, uint8_t *levels) {
+    uint32_t histogram[256] = {0};
+    uint32_t row_hist[256];
+    for (int y = 0; y < bmp.height; y++) {
+        row_histogram(bmp.pixels[y][0], bmp.width, row_hist);
+        for (int i = 0; i < 256; i++) {
+            histogram[i] += row_hist[i];
+        }
+
+        // Rows without both colours get the global level below
+        int level = mode == THRESHOLD_LOCAL ? otsu_level(row_hist) : -1;
+        levels[y] = level < 0 ? 0 : level;
+    }
+
+    // Fall back to mid grey if the whole barcode is a single colour
+    int global = otsu_level(histogram);
+    if (global < 0) {
+        global = 128;
+    }
+    for (int y = 0; y < bmp.height; y++) {
+        if (levels[y] == 0) {
+            levels[y] = global;
+        }
+    }
+}
+
+Threshold find_threshold(ThresholdMode mode, Bmp bmp) {
+    Threshold threshold = {mode, NULL};
+    if (mode == THRESHOLD_FIXED) {
+        return threshold;
+    }
+
+    threshold.levels = malloc(bmp.height > 0 ? bmp.height : 1);
+    assert_file_format(threshold.levels != NULL);
+    fill_threshold_levels(mode, bmp, threshold.levels);
+    return threshold;
+}
+
+void free_threshold(Threshold threshold) {
+    free(threshold.levels);
+}
+
+// The guard is alternating black and white columns, starting with black
+// Whether one scanline starts with the guard pattern
+bool scanline_has_guard(const Symbology *sym, const Threshold *threshold, Bmp bmp, bool vertical, int line) {
+    for (int k = 0; k < sym->guard_left; k++) {
+        int row = vertical ? k : line;
+        int col = vertical ? line : k;
+        if (is_black(threshold, bmp.pixels[row][col], row) != (k % 2 == 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check the guard on the first, middle and last scanline
+bool has_guard(const Symbology *sym, const Threshold *threshold, Bmp bmp, bool vertical) {
+    int scanlines = vertical ? bmp.width : bmp.height;
+    int samples[3] = {0, scanlines / 2, scanlines - 1};
+
+    for (int i = 0; i < 3; i++) {
+        if (!scanline_has_guard(sym, threshold, bmp, vertical, samples[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Find which way round the barcode is from where its guard is
+// The first data bit is always white, so if it is black the barcode is
+// being read from the wrong end. That is checked on the first scanline
+// with a guard, as stacked images can start with blank ones
+Orientation find_orientation(const Symbology *sym, const Threshold *threshold, Bmp bmp) {
+    int span = sym->guard_left + sym->frames * sym->frame_bits;
+    bool fits = bmp.width >= span && bmp.height > 0;
+    bool fits_vertical = bmp.height >= span && bmp.width > 0;
+    if (!fits && !fits_vertical) {
+        return ORIENT_NORMAL;
+    }
+
+    bool vertical = fits_vertical && (!fits || (!has_guard(sym, threshold, bmp, false) && has_guard(sym, threshold, bmp, true)));
+    int scanlines = vertical ? bmp.width : bmp.height;
+    int line = 0;
+    while (line + 1 < scanlines && !scanline_has_guard(sym, threshold, bmp, vertical, line)) {
+        line++;
+    }
+
+    if (vertical) {
+        return is_black(threshold, bmp.pixels[sym->guard_left][line], sym->guard_left) ? ORIENT_VERTICAL_REVERSED : ORIENT_VERTICAL;
+    }
+    return is_black(threshold, bmp.pixels[line][sym->guard_left], line) ? ORIENT_REVERSED : ORIENT_NORMAL;
+}
+
+bool is_vertical(Orientation orientation) {
+    return orientation == ORIENT_VERTICAL || orientation == ORIENT_VERTICAL_REVERSED;
+}
+
+// Number of scanlines across the barcode
+int count_scanlines(Orientation orientation, Bmp bmp) {
+    return is_vertical(orientation) ? bmp.width : bmp.height;
+}
+
+uint64_t reverse_word(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+    x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+    return (x >> 32) | (x << 32);
+}
+
+// Reverse the order of the first nbits bits of a packed row
+void reverse_packed_row(uint64_t bits[], int nbits) {
+    int words = (nbits + 63) / 64;
+    uint64_t reversed[MAX_ROW_WORDS];
+    for (int w = 0; w < words; w++) {
+        reversed[words - 1 - w] = reverse_word(bits[w]);
+    }
+
+    // The reversed bits end up at the top of the last word, shift them down
+    int shift = words * 64 - nbits;
+    for (int w = 0; w < words; w++) {
+        bits[w] = reversed[w];
+        if (shift != 0) {
+            bits[w] = (reversed[w] >> shift) | (w + 1 < words ? reversed[w + 1] << (64 - shift) : 0);
+        }
+    }
+}
+
+// Put a row packed as it was stored into barcode order, for images packed
+// a row at a time. The first data bit is always white, so which way round
+// the barcode is gets decided on the first row with a guard and kept for
+// the rest of the image, as find_orientation does. reversed starts at -1;
+// rows before the first guard go by their own first bit
+void orient_packed_row(const Symbology *sym, uint64_t bits[MAX_ROW_WORDS], bool guarded, int *reversed) {
+    bool reverse = *reversed == -1 ? (bits[0] & 1) != 0 : *reversed == 1;
+    if (guarded && *reversed == -1) {
+        *reversed = reverse;
+    }
+    if (reverse) {
+        reverse_packed_row(bits, sym->frames * sym->frame_bits);
+    }
+}
+
+// Pack the data columns of every row into bits, 1 for black
+// Bit j of a packed row is data column j, reading in barcode order
+void get_data_frame(const Symbology *sym, const Threshold *threshold, Orientation orientation, uint64_t packed[][MAX_ROW_WORDS], Bmp bmp){
+    int data_cols = sym->frames * sym->frame_bits;
+    int scanlines = count_scanlines(orientation, bmp);
+
+    for(int i = 0; i < scanlines; i++){
+        memset(packed[i], 0, sizeof(packed[i]));
+    }
+
+    if(!is_vertical(orientation)){
+        for(int i = 0; i < scanlines; i++){
+            unsigned char **row = bmp.pixels[i] + sym->guard_left;
+            for(int j = 0; j < data_cols; j++){
+                packed[i][j / 64] |= is_black(threshold, row[j], i) << (j % 64);
+            }
+        }
+    }else{
+        // Transpose only the barcode rows, a block of scanlines at a time
+        for(int x0 = 0; x0 < scanlines; x0 += TRANSPOSE_BLOCK){
+            int x1 = x0 + TRANSPOSE_BLOCK < scanlines ? x0 + TRANSPOSE_BLOCK : scanlines;
+            for(int j = 0; j < data_cols; j++){
+                unsigned char **row = bmp.pixels[j + sym->guard_left];
+                for(int x = x0; x < x1; x++){
+                    packed[x][j / 64] |= is_black(threshold, row[x], j + sym->guard_left) << (j % 64);
+                }
+            }
+        }
+    }
+
+    if(orientation == ORIENT_REVERSED || orientation == ORIENT_VERTICAL_REVERSED){
+        for(int i = 0; i < scanlines; i++){
+            reverse_packed_row(packed[i], data_cols);
+        }
+    }
+}
+
+// Column of the first black pixel in a row, -1 if there is none
+int find_edge(const Threshold *threshold, Bmp bmp, int row) {
+    for (int x = 0; x < bmp.width; x++) {
+        if (is_black(threshold, bmp.pixels[row][x], row)) {
+            return x;
+        }
+    }
+    return -1;
+}
+
+// Largest tilt -k copes with, as edge columns drifted per row (about 10 degrees)
+#define MAX_SKEW 0.18
+
+int64_t round_to_int(double x) {
+    return x < 0 ? -(int64_t)(0.5 - x) : (int64_t)(x + 0.5);
+}
+
+int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Least squares line through the edge columns of rows within max_distance
+// of the line edge0 + slope * row (or of edge0 alone when slope is NAN)
+bool fit_edge_line(const int edges[], int height, double max_distance, double *edge0, double *slope) {
+    double n = 0, sum_y = 0, sum_x = 0, sum_xy = 0, sum_yy = 0;
+    for(int y = 0; y < height; y++){
+        double expected = *edge0 + (*slope == *slope ? *slope * y : 0);
+        if(edges[y] >= 0 && fabs(edges[y] - expected) <= max_distance){
+            n++;
+            sum_y += y;
+            sum_x += edges[y];
+            sum_xy += (double)edges[y] * y;
+            sum_yy += (double)y * y;
+        }
+    }
+    if(n == 0){
+        return false;
+    }
+
+    double denominator = n * sum_yy - sum_y * sum_y;
+    *slope = denominator == 0 ? 0 : (n * sum_xy - sum_x * sum_y) / denominator;
+    *edge0 = (sum_x - *slope * sum_y) / n;
+    return true;
+}
+
+// Fit a line to the left edge of the barcode, edge column = edge0 + slope * row
+// Rows cut short by the tilt start far from the real edge, so the fit
+// starts from the median edge and is then refined without outliers
+bool fit_edge(const int edges[], int height, double *edge0, double *slope) {
+    int *sorted = malloc(sizeof(int) * (height > 0 ? height : 1));
+    assert_file_format(sorted != NULL);
+    int count = 0;
+    for(int y = 0; y < height; y++){
+        if(edges[y] >= 0){
+            sorted[count++] = edges[y];
+        }
+    }
+    if(count == 0){
+        free(sorted);
+        return false;
+    }
+    qsort(sorted, count, sizeof(int), compare_ints);
+    *edge0 = sorted[count / 2];
+    *slope = NAN;
+    free(sorted);
+
+    return fit_edge_line(edges, height, MAX_SKEW * height + 2, edge0, slope)
+        && fit_edge_line(edges, height, 1.5, edge0, slope);
+}
+
+// Pack the data columns of a slightly tilted barcode
+// The left guard edge is fitted to a line across rows (least squares),
+// giving the tilt. Each scanline then starts on that edge and steps one
+// column at a time while its row follows the tilt, Bresenham style, so
+// the image is never rotated. Scanlines that would leave the image or
+// miss either guard are dropped. Returns the number of scanlines packed,
+// with guarded (if not NULL) set for those that read the left guard
+int get_skewed_data_frame(const Symbology *sym, const Threshold *threshold, uint64_t packed[][MAX_ROW_WORDS], bool guarded[], Bmp bmp){
+    int data_cols = sym->frames * sym->frame_bits;
+    int length = sym->guard_left + data_cols + sym->guard_right;
+
+    // Fit edge column = edge0 + slope * row
+    int *edges = malloc(sizeof(int) * (bmp.height > 0 ? bmp.height : 1));
+    assert_file_format(edges != NULL);
+    for(int y = 0; y < bmp.height; y++){
+        edges[y] = find_edge(threshold, bmp, y);
+    }
+    double edge0 = 0;
+    double slope = 0;
+    if(!fit_edge(edges, bmp.height, &edge0, &slope)){
+        free(edges);
+        return 0;
+    }
+
+    // Scanlines run at right angles to the edge, so they climb -slope rows
+    // per column. Rows are tracked in 16.16 fixed point
+    int64_t step = round_to_int(-slope * 65536);
+
+    int scanlines = 0;
+    for(int y = 0; y < bmp.height; y++){
+        // Only start scanlines on rows where the barcode edge actually is
+        int x0 = (int)round_to_int(edge0 + slope * y);
+        if(edges[y] < 0 || fabs(edges[y] - (edge0 + slope * y)) > 1.5){
+            continue;
+        }
+        int64_t row = ((int64_t)y << 16) + (1 << 15);
+        int64_t last_row = (row + step * (length - 1)) >> 16;
+        if(x0 < 0 || x0 + length > bmp.width || last_row < 0 || last_row >= bmp.height){
+            continue;
+        }
+
+        // Walk the whole scanline, guards included
+        uint64_t *bits = packed[scanlines];
+        memset(bits, 0, sizeof(uint64_t) * MAX_ROW_WORDS);
+        bool on_barcode = true;
+        bool left_guard = true;
+        for(int c = 0; c < length; c++){
+            int r = row >> 16;
+            uint64_t black = is_black(threshold, bmp.pixels[r][x0 + c], r);
+            row += step;
+
+            int j = c - sym->guard_left;
+            if(j >= 0 && j < data_cols){
+                bits[j / 64] |= black << (j % 64);
+            }else{
+                // Both guards alternate starting with black, a scanline
+                // that drifts off the barcode loses one of them
+                int k = j < 0 ? c : j - data_cols;
+                on_barcode = on_barcode && black == (k % 2 == 0);
+                if(j < 0){
+                    left_guard = left_guard && black == (k % 2 == 0);
+                }
+            }
+        }
+        if(on_barcode){
+            if(guarded != NULL){
+                guarded[scanlines] = left_guard;
+            }
+            scanlines++;
+        }
+    }
+
+    free(edges);
+
+    // The first data bit is always white, see find_orientation
+    if(scanlines > 0 && (packed[0][0] & 1)){
+        for(int i = 0; i < scanlines; i++){
+            reverse_packed_row(packed[i], data_cols);
+        }
+    }
+
+    return scanlines;
+}
+
+// Set the bits of the columns that are black in more than half the rows
+// Each column keeps its count in bit sliced counters (bit b of every count
+// in counter[b]), so a row is added 64 columns per word operation
+void majority_row(uint64_t packed[][MAX_ROW_WORDS], int height, uint64_t majority[MAX_ROW_WORDS]){
+    uint64_t counter[32][MAX_ROW_WORDS];
+    int planes = 0;
+    while(planes < 32 && ((uint64_t)1 << planes) <= height){
+        planes++;
+    }
+    memset(counter, 0, sizeof(counter));
+
+    for(int i = 0; i < height; i++){
+        for(int w = 0; w < MAX_ROW_WORDS; w++){
+            uint64_t carry = packed[i][w];
+            for(int b = 0; b < planes && carry != 0; b++){
+                uint64_t next = counter[b][w] & carry;
+                counter[b][w] ^= carry;
+                carry = next;
+            }
+        }
+    }
+
+    // Compare every count with height / 2 from the top bit down
+    int half = height / 2;
+    for(int w = 0; w < MAX_ROW_WORDS; w++){
+        uint64_t greater = 0;
+        uint64_t equal = ~(uint64_t)0;
+        for(int b = planes - 1; b >= 0; b--){
+            if((half >> b) & 1){
+                equal &= counter[b][w];
+            }else{
+                greater |= equal & counter[b][w];
+                equal &= ~counter[b][w];
+            }
+        }
+        majority[w] = greater;
+    }
+}
+
+// How images are decoded, set from the command line
+typedef struct {
+    // NULL to pick the symbology from the image size
+    Symbology *sym;
+    ThresholdMode threshold_mode;
+    bool deskew;
+
+    // Vote across rows for frames that no single row reads
+    bool recover;
+
+    // Print how many rows back up each digit
+    bool confidence;
+
+    // Read every barcode stacked in the image, not just the first
+    bool stacked;
+
+    // Directory to write the scanlines of images that fail to, or NULL
+    char *failure_dir;
+
+    // Turn away images that can't hold a barcode as they are loaded, and
+    // if strict judge their sampled rows first, see screens_images
+    bool screen;
+    bool screen_strict;
+} DecodeOptions;
+
+// What was read from one image
+typedef struct {
+    int frames;
+
+    // Row the digits were read from, -1 if no row had every frame valid
+    int valid_row;
+    char digits[MAX_FRAMES];
+
+    // Frames without a single valid row, when valid_row is -1
+    int count_invalid;
+    int list_invalid[MAX_FRAMES];
+
+    // Frames read from the row vote, when valid_row is VOTED_ROW
+    int count_recovered;
+    int list_recovered[MAX_FRAMES];
+
+    // Confidence in each digit: of the rows checked, how many read the
+    // frame with valid parity and how many of those read the same digit
+    // rows is 0 when these were not counted
+    int rows;
+    int valid_rows[MAX_FRAMES];
+    int agreeing_rows[MAX_FRAMES];
+} DecodeResult;
+
+// valid_row of a result pieced together frame by frame, see decode_barcode
+#define VOTED_ROW -3
+
+// One barcode of a stacked image: a run of scanlines that all start with
+// a guard, with blank or guardless scanlines either side
+typedef struct {
+    int first_row;
+    int rows;
+    DecodeResult result;
+} Band;
+
+// Bands at least this many scanlines tall are decoded on threads of their
+// own, smaller ones are quicker to decode than to start a thread for
+#define BAND_THREAD_ROWS 2048
+
+// One image on its way through the decoder
+typedef struct {
+    // Position in the batch, results are written in this order
+    int index;
+    char *filename;
+    Symbology *sym;
+
+    // Barcode region of the image, until it is packed
+    Bmp bmp;
+
+    // One packed row per scanline, until it is decoded
+    int scanlines;
+    uint64_t (*packed)[MAX_ROW_WORDS];
+
+    // Whether each scanline starts with a guard, for stacked barcodes
+    bool *guarded;
+    Orientation orientation;
+
+    DecodeResult result;
+
+    // Each barcode found in a stacked image
+    int bands;
+    Band *band;
+
+    // Why the image could not be read, NULL if it was
+    const char *error;
+
+    // Set when the image was decoded as soon as it was read, see decode_tiny
+    bool decoded;
+
+    // Why the image was turned away unread, see screens_images
+    const char *rejected;
+} DecodeJob;
+
+// Palette image compressed with BI_RLE8 or BI_RLE4, as archived captures are
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+
+    // 8 or 4 bits per pixel
+    int bits;
+
+    // Red and luminance of each palette entry
+    uint8_t red[256];
+    uint8_t luma[256];
+
+    const uint8_t *stream;
+    size_t length;
+} RleImage;
+
+// Widest run of columns expanded from a compressed row
+#define MAX_RLE_COLS (GUARD_COLS + MAX_FRAMES * MAX_FRAME_BITS)
+
+// Whether the first length bytes of a file start a BI_RLE8 or BI_RLE4
+// bmp, and its size if so
+bool parse_rle_header(const uint8_t *data, size_t length, uint32_t *width, uint32_t *height) {
+    if (length < BMP_HEADER_SIZE || data[0] != 'B' || data[1] != 'M') {
+        return false;
+    }
+    uint16_t bits = *((uint16_t *)(data + PIXEL_SIZE_OFFSET));
+    uint32_t compression = *((uint32_t *)(data + COMPRESSION_OFFSET));
+    int32_t rows = *((int32_t *)(data + HEIGHT_OFFSET));
+
+    // Compressed images are always stored bottom row first
+    if (!((bits == 8 && compression == BI_RLE8) || (bits == 4 && compression == BI_RLE4)) || rows < 0) {
+        return false;
+    }
+    *width = *((uint32_t *)(data + WIDTH_OFFSET));
+    *height = rows;
+    return true;
+}
+
+// Fill in image from a whole BI_RLE8 or BI_RLE4 file held in memory
+// Returns false if it is not one
+bool parse_rle_bmp(const uint8_t *data, size_t length, RleImage *image) {
+    uint32_t width, height;
+    if (!parse_rle_header(data, length, &width, &height)) {
+        return false;
+    }
+
+    uint32_t pixel_array_offset = *((uint32_t *)(data + PIXEL_ARRAY_OFFSET));
+    uint32_t dib_size = *((uint32_t *)(data + DIB_SIZE_OFFSET));
+    uint16_t bits = *((uint16_t *)(data + PIXEL_SIZE_OFFSET));
+    uint32_t colors = *((uint32_t *)(data + COLORS_USED_OFFSET));
+    uint32_t data_size = *((uint32_t *)(data + DATA_SIZE_OFFSET));
+    if (colors == 0) {
+        colors = 1u << bits;
+    }
+
+    size_t palette = 14 + (size_t)dib_size;
+    if (colors > (1u << bits) || palette + 4 * (size_t)colors > pixel_array_offset || pixel_array_offset > length) {
+        return false;
+    }
+
+    memset(image, 0, sizeof(RleImage));
+    image->width = width;
+    image->height = height;
+    image->bits = bits;
+    for (int i = 0; i < colors; i++) {
+        const uint8_t *entry = data + palette + 4 * i;
+        image->red[i] = entry[2];
+        image->luma[i] = (77 * entry[2] + 150 * entry[1] + 29 * entry[0]) >> 8;
+    }
+    image->stream = data + pixel_array_offset;
+    image->length = length - pixel_array_offset;
+    if (data_size != 0 && data_size < image->length) {
+        image->length = data_size;
+    }
+
+    // Every row takes at least an end of line, 2 bytes, so a height the
+    // stream can't cover is a bad header, not rows to allocate
+    return height <= image->length / 2;
+}
+
+// Walk the compressed stream a row at a time, bottom row first, expanding
+// only the first cols pixels of each row into palette indices for
+// visit_row. Runs beyond cols are skipped over without being expanded
+// Pixels that no run covers are palette entry 0
+// Returns false if the stream is cut off in the middle of a run
+bool walk_rle(const RleImage *image, unsigned int cols, void (*visit_row)(void *ctx, unsigned int y, const uint8_t *indices), void *ctx) {
+    uint8_t indices[MAX_RLE_COLS];
+    cols = cols < image->width ? cols : image->width;
+    cols = cols < MAX_RLE_COLS ? cols : MAX_RLE_COLS;
+    memset(indices, 0, cols);
+
+    const uint8_t *stream = image->stream;
+    size_t i = 0;
+    unsigned int x = 0;
+    unsigned int y = 0;
+    while (y < image->height && i + 2 <= image->length) {
+        unsigned int count = stream[i];
+        unsigned int value = stream[i + 1];
+        i += 2;
+
+        if (count > 0) {
+            // Encoded run, RLE4 alternates between the two nibbles
+            uint8_t first = image->bits == 8 ? value : value >> 4;
+            uint8_t second = image->bits == 8 ? value : value & 15;
+            for (unsigned int k = x; k < x + count && k < cols; k++) {
+                indices[k] = (k - x) % 2 == 0 ? first : second;
+            }
+            x += count;
+        } else if (value == 0 || value == 1) {
+            // End of row, or end of image
+            visit_row(ctx, y++, indices);
+            memset(indices, 0, cols);
+            x = 0;
+            if (value == 1) {
+                break;
+            }
+        } else if (value == 2) {
+            // Move right and up, leaving the pixels passed over blank
+            if (i + 2 > image->length) {
+                return false;
+            }
+            x += stream[i];
+            for (int dy = 0; dy < stream[i + 1] && y < image->height; dy++) {
+                visit_row(ctx, y++, indices);
+                memset(indices, 0, cols);
+            }
+            i += 2;
+        } else {
+            // Absolute run of value pixels, padded to a whole word
+            size_t bytes = image->bits == 8 ? value : (value + 1) / 2;
+            if (i + bytes > image->length) {
+                return false;
+            }
+            for (unsigned int k = x; k < x + value && k < cols; k++) {
+                unsigned int n = k - x;
+                indices[k] = image->bits == 8 ? stream[i + n] : (n % 2 == 0 ? stream[i + n / 2] >> 4 : stream[i + n / 2] & 15);
+            }
+            x += value;
+            i += (bytes + 1) & ~(size_t)1;
+        }
+    }
+
+    // Rows the stream never reached are blank
+    while (y < image->height) {
+        visit_row(ctx, y++, indices);
+    }
+    return true;
+}
+
+// Packs rows of palette indices (or grey levels) one at a time, as they
+// come out of a compressed or text image
+typedef struct {
+    const Symbology *sym;
+    ThresholdMode threshold_mode;
+
+    // Red and luminance of each index
+    const uint8_t *red;
+    const uint8_t *luma;
+    unsigned int cols;
+
+    // First pass: luminance histogram of the barcode region
+    bool counting;
+    uint32_t histogram[256];
+    int level;
+
+    uint64_t (*packed)[MAX_ROW_WORDS];
+    bool *guarded;
+
+    // Which way round the barcode is, see orient_packed_row
+    int reversed;
+} RowPacker;
+
+void pack_index_row(void *ctx, unsigned int y, const uint8_t *indices) {
+    RowPacker *packer = ctx;
+    const Symbology *sym = packer->sym;
+
+    if (packer->counting) {
+        for (int x = 0; x < packer->cols; x++) {
+            packer->histogram[packer->luma[indices[x]]]++;
+        }
+        return;
+    }
+
+    // Rows without both colours get the level of the whole barcode
+    int level = packer->level;
+    if (packer->threshold_mode == THRESHOLD_LOCAL) {
+        uint32_t histogram[256];
+        memset(histogram, 0, sizeof(histogram));
+        for (int x = 0; x < packer->cols; x++) {
+            histogram[packer->luma[indices[x]]]++;
+        }
+        int row_level = otsu_level(histogram);
+        level = row_level < 0 ? level : row_level;
+    }
+
+    uint8_t black[MAX_RLE_COLS];
+    for (int x = 0; x < packer->cols; x++) {
+        black[x] = packer->threshold_mode == THRESHOLD_FIXED ? packer->red[indices[x]] == 0 : packer->luma[indices[x]] < level;
+    }
+
+    packer->guarded[y] = true;
+    for (int k = 0; k < sym->guard_left; k++) {
+        packer->guarded[y] &= black[k] == (k % 2 == 0);
+    }
+
+    int data_cols = sym->frames * sym->frame_bits;
+    uint64_t *bits = packer->packed[y];
+    memset(bits, 0, sizeof(uint64_t) * MAX_ROW_WORDS);
+    for (int j = 0; j < data_cols; j++) {
+        bits[j / 64] |= (uint64_t)black[sym->guard_left + j] << (j % 64);
+    }
+    orient_packed_row(sym, bits, packer->guarded[y], &packer->reversed);
+}
+
+// Read the whole of an opened file into memory, free it with free_image_file
+uint8_t *read_whole_file(int fd, size_t *length) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fail_image(image_read_error, NULL);
+    }
+    uint8_t *data = image_alloc(st.st_size);
+    assert_file_format(data != NULL);
+    image_file = data;
+    check_read(pread(fd, data, st.st_size, 0), st.st_size);
+    *length = st.st_size;
+    return data;
+}
+
+// Read a whole BI_RLE8 or BI_RLE4 file, the image points into the buffer
+// returned, which the caller frees with free_image_file
+uint8_t *read_rle_bmp(int fd, RleImage *image) {
+    size_t length;
+    uint8_t *data = read_whole_file(fd, &length);
+    assert_file_format(parse_rle_bmp(data, length, image));
+    return data;
+}
+
+// Whether images that can't hold a barcode are turned away. They never
+// are when failures are traced or dumped (-T, -F), so those recipes see
+// every image, nor for deskewed or stacked barcodes
+bool screens_images(const DecodeOptions *options) {
+    return options->screen && !options->deskew && !options->stacked && options->failure_dir == NULL && trace_path == NULL;
+}
+
+// Turn the job away if the image is smaller than the barcode both ways
+// round, judged from the header the loader reads anyway
+bool reject_small_image(DecodeJob *job, const DecodeOptions *options, const Symbology *sym, uint32_t width, uint32_t height) {
+    int span = sym->guard_left + sym->frames * sym->frame_bits;
+    if(screens_images(options) && width < span && height < span){
+        job->rejected = "image too small for a barcode";
+    }
+    return job->rejected != NULL;
+}
+
+// Set up a job and packer for an image packed a row at a time
+// Images too narrow for the barcode get no scanlines
+// Returns false, with nothing allocated, if the image is turned away
+bool start_row_packing(DecodeJob *job, const DecodeOptions *options, RowPacker *packer, unsigned int width, unsigned int height) {
+    if(job->sym == NULL){
+        job->sym = symbology_for_size(width, 0);
+    }
+    if(reject_small_image(job, options, job->sym, width, height)){
+        return false;
+    }
+
+    memset(packer, 0, sizeof(RowPacker));
+    packer->reversed = -1;
+    packer->sym = job->sym;
+    packer->threshold_mode = options->threshold_mode;
+    packer->cols = job->sym->guard_left + job->sym->frames * job->sym->frame_bits;
+
+    job->scanlines = width >= packer->cols ? height : 0;
+    job->packed = malloc(sizeof(job->packed[0]) * (job->scanlines > 0 ? job->scanlines : 1));
+    job->guarded = malloc(sizeof(bool) * (job->scanlines > 0 ? job->scanlines : 1));
+    assert_file_format(job->packed != NULL && job->guarded != NULL);
+    packer->packed = job->packed;
+    packer->guarded = job->guarded;
+    return true;
+}
+
+// Guard flags are only kept to split stacked barcodes and for failure dumps
+void finish_row_packing(DecodeJob *job, const DecodeOptions *options) {
+    if(!options->stacked && options->failure_dir == NULL){
+        free(job->guarded);
+        job->guarded = NULL;
+    }
+}
+
+// Pack a BI_RLE8 or BI_RLE4 image straight from its run stream, so the
+// expanded image is never held in memory, only one row of the barcode
+// columns at a time. Rows are read as horizontal barcodes
+void load_rle_barcode(DecodeJob *job, const DecodeOptions *options, int fd) {
+    RleImage image;
+    uint8_t *data = read_rle_bmp(fd, &image);
+    RowPacker packer;
+    if(!start_row_packing(job, options, &packer, image.width, image.height)){
+        free_image_file(data);
+        return;
+    }
+    packer.red = image.red;
+    packer.luma = image.luma;
+
+    if(job->scanlines > 0){
+        if(options->threshold_mode != THRESHOLD_FIXED){
+            packer.counting = true;
+            assert_file_format(walk_rle(&image, packer.cols, pack_index_row, &packer));
+            packer.counting = false;
+            packer.level = otsu_level(packer.histogram);
+            packer.level = packer.level < 0 ? 128 : packer.level;
+        }
+        assert_file_format(walk_rle(&image, packer.cols, pack_index_row, &packer));
+    }
+
+    finish_row_packing(job, options);
+    free_image_file(data);
+}
+
+// Netpbm image: P1 and P4 bitmaps (1 is black), P2 and P5 greymaps
+// P1 and P2 are text, P4 and P5 binary
+typedef struct {
+    char kind;
+    uint32_t width;
+    uint32_t height;
+    uint32_t maxval;
+
+    // Pixel data, just past the header
+    const uint8_t *raster;
+    size_t length;
+} PnmImage;
+
+// Skip whitespace and # comments in a netpbm header or text raster
+static inline size_t pnm_skip(const uint8_t *data, size_t length, size_t pos) {
+    while (pos < length) {
+        if (data[pos] == '#') {
+            while (pos < length && data[pos] != '\n') {
+                pos++;
+            }
+        } else if (data[pos] == ' ' || data[pos] == '\t' || data[pos] == '\n' || data[pos] == '\r') {
+            pos++;
+        } else {
+            break;
+        }
+    }
+    return pos;
+}
+
+// Read the next number of a netpbm header or text raster
+// P1 pixels can be written without spaces, so they are read one digit at
+// a time. Returns false if there is no number
+bool pnm_number(const uint8_t *data, size_t length, size_t *pos, bool one_digit, uint32_t *value) {
+    size_t i = pnm_skip(data, length, *pos);
+    if (i >= length || data[i] < '0' || data[i] > '9') {
+        return false;
+    }
+    uint64_t n = 0;
+    while (i < length && data[i] >= '0' && data[i] <= '9' && n <= UINT32_MAX) {
+        n = n * 10 + data[i++] - '0';
+        if (one_digit) {
+            break;
+        }
+    }
+    *pos = i;
+    *value = n;
+    return n <= UINT32_MAX;
+}
+
+// Fill in the kind, size and maxval of a netpbm image from the start of
+// its file, and where its raster starts
+// Returns false if it is not a P1, P2, P4 or P5 file
+bool parse_pnm_header(const uint8_t *data, size_t length, PnmImage *image, size_t *raster) {
+    if (length < 2 || data[0] != 'P' || strchr("1245", data[1]) == NULL || data[1] == '\0') {
+        return false;
+    }
+
+    memset(image, 0, sizeof(PnmImage));
+    image->kind = data[1];
+    image->maxval = 1;
+    size_t pos = 2;
+    if (!pnm_number(data, length, &pos, false, &image->width) || !pnm_number(data, length, &pos, false, &image->height)) {
+        return false;
+    }
+    if ((image->kind == '2' || image->kind == '5')
+        && (!pnm_number(data, length, &pos, false, &image->maxval) || image->maxval == 0 || image->maxval > 65535)) {
+        return false;
+    }
+    if (image->height > INT32_MAX) {
+        return false;
+    }
+
+    // A single whitespace character separates a binary raster from the header
+    if (image->kind == '4' || image->kind == '5') {
+        pos++;
+    }
+    *raster = pos;
+    return pos <= length;
+}
+
+// Fill in image from a whole netpbm file held in memory
+// Returns false if it is not a P1, P2, P4 or P5 file
+bool parse_pnm(const uint8_t *data, size_t length, PnmImage *image) {
+    size_t pos;
+    if (!parse_pnm_header(data, length, image, &pos)) {
+        return false;
+    }
+    image->raster = data + pos;
+    image->length = length - pos;
+
+    // Binary rasters have to be all there. A text raster takes at least a
+    // digit per P1 pixel and a digit and separator per P2 sample, so a
+    // height it can't cover is never allocated
+    uint64_t pixels = (uint64_t)image->width * image->height;
+    if (image->kind == '1') {
+        return pixels <= image->length;
+    }
+    if (image->kind == '2') {
+        return pixels <= (image->length + 1) / 2;
+    }
+    uint64_t row_bytes = image->kind == '4' ? (image->width + 7) / 8 : (uint64_t)image->width * (image->maxval > 255 ? 2 : 1);
+    return row_bytes * image->height <= image->length;
+}
+
+// Bytes read for the header of a netpbm image, comments included
+#define PNM_HEADER_MAX 1024
+
+// Width and height of an opened image of any kind that can be decoded,
+// from its header alone: the bmp headers, or a netpbm magic and dimensions
+// Returns false if the file is none of them
+bool read_image_size_fd(int fd, uint32_t *width, uint32_t *height) {
+    uint8_t head[PNM_HEADER_MAX];
+    ssize_t length = pread(fd, head, sizeof(head), 0);
+    if (length < 2) {
+        return false;
+    }
+    if (head[0] == 'P') {
+        PnmImage image;
+        size_t raster;
+        if (!parse_pnm_header(head, length, &image, &raster)) {
+            return false;
+        }
+        *width = image.width;
+        *height = image.height;
+        return true;
+    }
+    BmpHeader header;
+    if (read_bmp_header_fd(fd, &header)) {
+        *width = header.width;
+        *height = header.height;
+        return true;
+    }
+    return parse_rle_header(head, length, width, height);
+}
+
+// Walk a directory and print one metadata index line per file:
+// path, width, height, file size and whether the header is valid
+// Only the header of each file is read, never the pixel array
+void scan_bmp_directory(char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open directory %s\n", path);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char entry_path[4096];
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+
+        int fd = openat(dirfd(dir), entry->d_name, O_RDONLY);
+        if (fd < 0) {
+            printf("%s\t-\t-\t-\tunreadable\n", entry_path);
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+            close(fd);
+            scan_bmp_directory(entry_path);
+            continue;
+        }
+
+        uint32_t width, height;
+        if (read_image_size_fd(fd, &width, &height)) {
+            printf("%s\t%u\t%u\t%llu\tok\n", entry_path, width, height, (unsigned long long)st.st_size);
+        } else {
+            printf("%s\t-\t-\t-\tformat_error\n", entry_path);
+        }
+        close(fd);
+    }
+
+    closedir(dir);
+}
+
+// Walk a P1, P2 or P5 raster a row at a time, turning the first cols
+// pixels of each row into grey levels 0 to 255 (P1 pixels stay 1 for
+// black and 0 for white) for visit_row
+// Rows are numbered from the bottom of the image, as a bmp stores them
+// Returns false if a text raster runs out early
+bool walk_pnm(const PnmImage *image, unsigned int cols, void (*visit_row)(void *ctx, unsigned int y, const uint8_t *indices), void *ctx) {
+    uint8_t indices[MAX_RLE_COLS];
+    cols = cols < image->width ? cols : image->width;
+    cols = cols < MAX_RLE_COLS ? cols : MAX_RLE_COLS;
+
+    int sample_bytes = image->maxval > 255 ? 2 : 1;
+    size_t pos = 0;
+    for (unsigned int r = 0; r < image->height; r++) {
+        if (image->kind == '5') {
+            const uint8_t *row = image->raster + (size_t)r * image->width * sample_bytes;
+            for (unsigned int x = 0; x < cols; x++) {
+                uint32_t value = sample_bytes == 2 ? (row[2 * x] << 8) | row[2 * x + 1] : row[x];
+                indices[x] = value * 255 / image->maxval;
+            }
+        } else {
+            for (unsigned int x = 0; x < image->width; x++) {
+                uint32_t value;
+                if (!pnm_number(image->raster, image->length, &pos, image->kind == '1', &value)) {
+                    return false;
+                }
+                if (x < cols) {
+                    value = value < image->maxval ? value : image->maxval;
+                    indices[x] = image->kind == '1' ? value : value * 255 / image->maxval;
+                }
+            }
+        }
+        visit_row(ctx, image->height - 1 - r, indices);
+    }
+    return true;
+}
+
+// PBM rows are already one bit per pixel, 1 for black, with the first
+// pixel in the top bit of each byte. They only need their bits turned
+// round and shifted past the guard to become packed frames
+void pack_pbm_row(const Symbology *sym, const uint8_t *row, unsigned int cols, uint64_t bits[MAX_ROW_WORDS], bool *guarded, int *reversed) {
+    uint64_t words[MAX_ROW_WORDS + 1];
+    int bytes = (cols + 7) / 8;
+    memset(words, 0, sizeof(words));
+    for (int w = 0; w * 8 < bytes; w++) {
+        uint64_t word = 0;
+        for (int b = 0; b < 8; b++) {
+            word = (word << 8) | (w * 8 + b < bytes ? row[w * 8 + b] : 0);
+        }
+        words[w] = reverse_word(word);
+    }
+
+    uint64_t guard = 0;
+    for (int k = 0; k < sym->guard_left; k += 2) {
+        guard |= (uint64_t)1 << k;
+    }
+    uint64_t guard_mask = ((uint64_t)1 << sym->guard_left) - 1;
+    *guarded = (words[0] & guard_mask) == guard;
+
+    int data_cols = sym->frames * sym->frame_bits;
+    int shift = sym->guard_left;
+    for (int w = 0; w < MAX_ROW_WORDS; w++) {
+        bits[w] = shift == 0 ? words[w] : (words[w] >> shift) | (words[w + 1] << (64 - shift));
+    }
+    for (int w = 0; w < MAX_ROW_WORDS; w++) {
+        int used = data_cols - 64 * w;
+        bits[w] &= used >= 64 ? ~(uint64_t)0 : used <= 0 ? 0 : ((uint64_t)1 << used) - 1;
+    }
+    orient_packed_row(sym, bits, *guarded, reversed);
+}
+
+// Pack a netpbm image, read as horizontal barcodes
+// P4 rows are mapped onto frames directly and need no threshold; the other
+// kinds are thresholded like any other image, greymaps never with the
+// fixed threshold
+void load_pnm_barcode(DecodeJob *job, const DecodeOptions *options, int fd) {
+    size_t length;
+    uint8_t *data = read_whole_file(fd, &length);
+    PnmImage image;
+    assert_file_format(parse_pnm(data, length, &image));
+    RowPacker packer;
+    if(!start_row_packing(job, options, &packer, image.width, image.height)){
+        free_image_file(data);
+        return;
+    }
+
+    if(job->scanlines > 0 && image.kind == '4'){
+        size_t row_bytes = (image.width + 7) / 8;
+        for(int r = 0; r < image.height; r++){
+            int y = image.height - 1 - r;
+            pack_pbm_row(job->sym, image.raster + r * row_bytes, packer.cols, job->packed[y], &job->guarded[y], &packer.reversed);
+        }
+    }else if(job->scanlines > 0){
+        // Grey levels stand for themselves, P1 has 1 for black
+        uint8_t grey[256];
+        uint8_t bitmap[256] = {255, 0};
+        for(int i = 0; i < 256; i++){
+            grey[i] = i;
+        }
+        packer.red = packer.luma = image.kind == '1' ? bitmap : grey;
+
+        // A greymap's darkest grey needn't be 0, so the fixed threshold
+        // would read every pixel as white; use the level of the image
+        if(image.kind != '1' && packer.threshold_mode == THRESHOLD_FIXED){
+            packer.threshold_mode = THRESHOLD_OTSU;
+        }
+        if(packer.threshold_mode != THRESHOLD_FIXED){
+            packer.counting = true;
+            assert_file_format(walk_pnm(&image, packer.cols, pack_index_row, &packer));
+            packer.counting = false;
+            packer.level = otsu_level(packer.histogram);
+            packer.level = packer.level < 0 ? 128 : packer.level;
+        }
+        assert_file_format(walk_pnm(&image, packer.cols, pack_index_row, &packer));
+    }
+
+    finish_row_packing(job, options);
+    free_image_file(data);
+}
+
+// Load the part of an image the barcode is in
+// Only the guard and the data frames are decoded, leave the rest of
+// wide images on disk
+void load_barcode(DecodeJob *job, const DecodeOptions *options) {
+    char *filename = job->filename;
+    job->sym = options->sym;
+
+    if(strcmp(filename, "-") == 0){
+        job->bmp = read_bmp(filename);
+        if(job->sym == NULL){
+            job->sym = symbology_for_size(job->bmp.width, job->bmp.height);
+        }
+    }else if(options->deskew){
+        // A tilted barcode drifts across the image, so load every column
+        job->bmp = read_bmp(filename);
+        if(job->sym == NULL){
+            job->sym = symbology_for_size(job->bmp.width, 0);
+        }
+    }else{
+        int fd = open_image(filename);
+        BmpHeader header;
+        uint8_t magic[2] = {0};
+        bool netpbm = pread(fd, magic, 2, 0) == 2 && magic[0] == 'P';
+        bool uncompressed = !netpbm && read_bmp_header_fd(fd, &header);
+        if(netpbm){
+            load_pnm_barcode(job, options, fd);
+        }else if(!uncompressed){
+            load_rle_barcode(job, options, fd);
+        }
+        close_image(fd);
+        if(!uncompressed){
+            return;
+        }
+
+        if(job->sym == NULL){
+            job->sym = symbology_for_size(header.width, header.height);
+        }
+        if(reject_small_image(job, options, job->sym, header.width, header.height)){
+            return;
+        }
+        int span = job->sym->guard_left + job->sym->frames * job->sym->frame_bits;
+        job->bmp = read_bmp_roi(filename, 0, UINT32_MAX, 0, span);
+    }
+}
+
+// Threshold the barcode region and pack its scanlines into bits
+void pack_barcode(DecodeJob *job, const DecodeOptions *options) {
+
+    // Compressed images are packed as they are loaded
+    if(job->packed != NULL){
+        return;
+    }
+    Symbology *sym = job->sym;
+    Bmp bmp = job->bmp;
+    Threshold threshold = find_threshold(options->threshold_mode, bmp);
+    image_levels = threshold.levels;
+    Orientation orientation = ORIENT_NORMAL;
+    int span = sym->guard_left + sym->frames * sym->frame_bits;
+
+    if(!options->deskew){
+        orientation = find_orientation(sym, &threshold, bmp);
+
+        // A barcode on its side needs the bottom rows instead
+        if(is_vertical(orientation) && strcmp(job->filename, "-") != 0 && read_bmp_header(job->filename).width > bmp.width){
+            free_bmp(bmp);
+            free_threshold(threshold);
+            image_levels = NULL;
+            job->bmp.header = NULL;
+            bmp = job->bmp = read_bmp_roi(job->filename, 0, span, 0, UINT32_MAX);
+            threshold = find_threshold(options->threshold_mode, bmp);
+            image_levels = threshold.levels;
+        }
+    }
+
+    // Get DataFrame
+    job->orientation = orientation;
+    job->scanlines = count_scanlines(orientation, bmp);
+    job->packed = malloc(sizeof(job->packed[0]) * (job->scanlines > 0 ? job->scanlines : 1));
+    assert_file_format(job->packed != NULL);
+    // Scanlines between stacked barcodes have no guard
+    if(options->stacked || options->failure_dir != NULL){
+        job->guarded = malloc(sizeof(bool) * (job->scanlines > 0 ? job->scanlines : 1));
+        assert_file_format(job->guarded != NULL);
+    }
+    if(options->deskew){
+        // The guards are read off the same tilted samples as the data
+        job->scanlines = get_skewed_data_frame(sym, &threshold, job->packed, job->guarded, bmp);
+    }else if((is_vertical(orientation) ? bmp.height : bmp.width) < span){
+        // Too small for the barcode either way round, nothing to scan
+        job->scanlines = 0;
+    }else{
+        get_data_frame(sym, &threshold, orientation, job->packed, bmp);
+    }
+
+    if(job->guarded != NULL && !options->deskew){
+        for(int i = 0; i < job->scanlines; i++){
+            job->guarded[i] = scanline_has_guard(sym, &threshold, bmp, is_vertical(orientation), i);
+        }
+    }
+
+    free_threshold(threshold);
+    image_levels = NULL;
+    free_bmp(bmp);
+    job->bmp.header = NULL;
+}
+
+// What has been learned from the rows of a barcode so far, in the same
+// memory however many rows there are
+typedef struct {
+    const Symbology *sym;
+    int rows;
+
+    // Bit f is set once frame f has been valid in some row
+    uint32_t seen_valid;
+
+    // First row with every frame valid and its frame values, -1 until then
+    int valid_row;
+    uint16_t row_value[MAX_FRAMES];
+
+    // Value of each frame in the first row where it was valid
+    uint16_t first_value[MAX_FRAMES];
+
+    // Rows where each frame was valid, by the digit they read
+    uint32_t digit_rows[MAX_FRAMES][256];
+} RowTally;
+
+void tally_start(RowTally *tally, const Symbology *sym) {
+    memset(tally, 0, sizeof(RowTally));
+    tally->sym = sym;
+    tally->valid_row = -1;
+}
+
+// Add the next row, given the value and parity of each of its frames
+void tally_row(RowTally *tally, const uint16_t *values, const int *valid) {
+    const Symbology *sym = tally->sym;
+    uint32_t row_valid = 0;
+    for(int f = 0; f < sym->frames; f++){
+        if(valid[f]){
+            row_valid |= 1u << f;
+            tally->digit_rows[f][(uint8_t)sym->digit[values[f]]]++;
+            if(!(tally->seen_valid & (1u << f))){
+                tally->first_value[f] = values[f];
+            }
+        }
+    }
+    tally->seen_valid |= row_valid;
+
+    if(tally->valid_row == -1 && row_valid == (1u << sym->frames) - 1){
+        tally->valid_row = tally->rows;
+        memcpy(tally->row_value, values, sizeof(uint16_t) * sym->frames);
+    }
+    trace(TRACE_ROW, 0, tally->rows, row_valid);
+    tally->rows++;
+}
+
+// Rows that read each frame with valid parity, and those that agree with
+// the digit in the result
+void tally_confidence(const RowTally *tally, DecodeResult *result) {
+    result->rows = tally->rows;
+    for(int f = 0; f < tally->sym->frames; f++){
+        result->valid_rows[f] = 0;
+        for(int d = 0; d < 256; d++){
+            result->valid_rows[f] += tally->digit_rows[f][d];
+        }
+        result->agreeing_rows[f] = result->valid_row == -1 ? 0 : tally->digit_rows[f][(uint8_t)result->digits[f]];
+    }
+}
+
+// Fill in a result from the rows seen: the digits of the first valid row,
+// or else the frames that were never valid
+// Confidence counts every row, including any after the valid one
+void tally_result(const RowTally *tally, DecodeResult *result) {
+    const Symbology *sym = tally->sym;
+    int frames = sym->frames;
+    result->frames = frames;
+    result->valid_row = tally->valid_row;
+    result->count_invalid = 0;
+    result->count_recovered = 0;
+    trace(TRACE_RESULT, 0, (uint32_t)tally->valid_row, tally->seen_valid);
+
+    if(tally->valid_row == -1){
+        for(int f = 0; f < frames; f++){
+            if(!(tally->seen_valid & (1u << f))){
+                result->list_invalid[result->count_invalid++] = f;
+            }
+        }
+    }else{
+        for(int f = 0; f < frames; f++){
+            result->digits[f] = sym->digit[tally->row_value[f]];
+        }
+    }
+    tally_confidence(tally, result);
+}
+
+// Check the parity of every frame and read the digits from the first
+// row where all frames are valid
+// With recovery on and no such row, each frame is read from the first row
+// where it is valid, and frames valid in no row from the majority of all
+// rows, as long as the voted frame passes its parity check
+void decode_rows(const Symbology *sym, const DecodeOptions *options, uint64_t packed[][MAX_ROW_WORDS], int scanlines, DecodeResult *result) {
+    int frames = sym->frames;
+
+    // Rows are tallied one at a time, so no per row state is kept
+    RowTally tally;
+    tally_start(&tally, sym);
+
+    // -k can find no scanlines at all, leaving nothing to tally or vote on
+    if(scanlines <= 0){
+        tally_result(&tally, result);
+        return;
+    }
+    for(int i = 0; i < scanlines; i++){
+        uint16_t values[MAX_FRAMES];
+        int valid[MAX_FRAMES];
+        sym->decode_row(sym, packed[i], values, valid);
+        tally_row(&tally, values, valid);
+    }
+    tally_result(&tally, result);
+
+    if(result->valid_row == -1 && options->recover){
+        uint64_t majority[MAX_ROW_WORDS];
+        uint16_t voted_value[MAX_FRAMES];
+        int voted_parity[MAX_FRAMES];
+        majority_row(packed, scanlines, majority);
+        sym->decode_row(sym, majority, voted_value, voted_parity);
+
+        int read = 0;
+        for(int i = 0; i < frames; i++){
+            if(!(tally.seen_valid & (1u << i))){
+                trace(TRACE_VOTE, i, voted_parity[i] != 0, voted_value[i]);
+            }
+            if(tally.seen_valid & (1u << i)){
+                result->digits[i] = sym->digit[tally.first_value[i]];
+                read++;
+            }else if(voted_parity[i]){
+                result->digits[i] = sym->digit[voted_value[i]];
+                result->list_recovered[result->count_recovered++] = i;
+                read++;
+            }
+        }
+        if(read == frames){
+            result->valid_row = VOTED_ROW;
+            result->count_invalid = 0;
+            tally_confidence(&tally, result);
+        }else{
+            result->count_recovered = 0;
+        }
+    }
+}
+
+typedef struct {
+    const Symbology *sym;
+    const DecodeOptions *options;
+    uint64_t (*packed)[MAX_ROW_WORDS];
+    Band *band;
+
+    // Set when the band has a thread of its own, whose ring is then held
+    // for the caller's failure dump from where the band starts
+    bool threaded;
+    TraceRing *trace_ring;
+    uint64_t trace_start;
+} BandTask;
+
+void *decode_band_thread(void *arg) {
+    BandTask *task = arg;
+    trace(TRACE_BAND, 0, task->band->first_row, task->band->rows);
+    if(task->threaded && trace_ring != NULL){
+        task->trace_start = trace_ring->head - 1;
+        task->trace_ring = trace_hold();
+    }
+    decode_rows(task->sym, task->options, task->packed + task->band->first_row, task->band->rows, &task->band->result);
+    return NULL;
+}
+
+// Split the scanlines of a stacked image into bands and decode each one
+void decode_bands(DecodeJob *job, const DecodeOptions *options) {
+    int capacity = 0;
+    job->bands = 0;
+    job->band = NULL;
+    for(int i = 0; i < job->scanlines; i++){
+        if(!job->guarded[i] || (i > 0 && job->guarded[i - 1])){
+            continue;
+        }
+        if(job->bands == capacity){
+            capacity = capacity * 2 + 4;
+            job->band = realloc(job->band, sizeof(Band) * capacity);
+            assert_file_format(job->band != NULL);
+        }
+        Band *band = &job->band[job->bands++];
+        memset(band, 0, sizeof(Band));
+        band->first_row = i;
+        while(i < job->scanlines && job->guarded[i]){
+            i++;
+        }
+        band->rows = i - band->first_row;
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (job->bands > 0 ? job->bands : 1));
+    BandTask *tasks = malloc(sizeof(BandTask) * (job->bands > 0 ? job->bands : 1));
+    bool *threaded = malloc(sizeof(bool) * (job->bands > 0 ? job->bands : 1));
+    assert_file_format(threads != NULL && tasks != NULL && threaded != NULL);
+    for(int b = 0; b < job->bands; b++){
+        tasks[b] = (BandTask){.sym = job->sym, .options = options, .packed = job->packed, .band = &job->band[b], .threaded = true};
+        threaded[b] = job->band[b].rows >= BAND_THREAD_ROWS && pthread_create(&threads[b], NULL, decode_band_thread, &tasks[b]) == 0;
+        if(!threaded[b]){
+            tasks[b].threaded = false;
+            decode_band_thread(&tasks[b]);
+        }
+    }
+    for(int b = 0; b < job->bands; b++){
+        if(threaded[b]){
+            pthread_join(threads[b], NULL);
+            trace_adopt(tasks[b].trace_ring, tasks[b].trace_start);
+        }
+    }
+    free(threads);
+    free(tasks);
+    free(threaded);
+}
+
+// Whether any barcode of an image went unread, to dump its trace and rows
+bool job_failed(const DecodeJob *job, const DecodeOptions *options) {
+    if(job->rejected != NULL){
+        return false;
+    }
+    if(!options->stacked){
+        return job->result.valid_row == -1;
+    }
+    bool failed = job->bands == 0;
+    for(int b = 0; b < job->bands; b++){
+        failed |= job->band[b].result.valid_row == -1;
+    }
+    return failed;
+}
+
+// Size of the header of a 1 bit bmp: file and info headers and a two
+// colour palette
+#define MONO_HEADER_SIZE (BMP_HEADER_SIZE + 8)
+
+static inline void put_le32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+// Write the scanlines of a failed image as the decoder saw them, to a 1 bit
+// bmp in options->failure_dir named after the image
+// Columns are the guard and the data frames. The guard is drawn where the
+// scanline had one, and left white where it did not or was not checked
+// A run of identical scanlines is written once. Above them, after a white
+// row, a row is black under each frame that could not be read
+void dump_failure(const DecodeJob *job, const DecodeOptions *options) {
+    const Symbology *sym = job->sym;
+    int data_cols = sym->frames * sym->frame_bits;
+    int width = sym->guard_left + data_cols;
+    size_t row_size = (width + 31) / 32 * 4;
+
+    // Frames to mark, from every barcode that failed
+    uint32_t failed_frames = 0;
+    const DecodeResult *result = options->stacked ? NULL : &job->result;
+    for(int b = 0; b < (options->stacked ? job->bands : 1); b++){
+        result = options->stacked ? &job->band[b].result : result;
+        for(int i = 0; result->valid_row == -1 && i < result->count_invalid; i++){
+            failed_frames |= 1u << result->list_invalid[i];
+        }
+    }
+
+    // Distinct scanlines, then a white row and the marker row
+    int *kept = malloc(sizeof(int) * (job->scanlines > 0 ? job->scanlines : 1));
+    uint8_t *image = calloc((size_t)(job->scanlines + 2), row_size);
+    if(kept == NULL || image == NULL){
+        free(kept);
+        free(image);
+        return;
+    }
+    int rows = 0;
+    for(int i = 0; i < job->scanlines; i++){
+        bool guard = job->guarded != NULL && job->guarded[i];
+        bool same = rows > 0 && memcmp(job->packed[i], job->packed[kept[rows - 1]], sizeof(job->packed[i])) == 0
+            && guard == (job->guarded != NULL && job->guarded[kept[rows - 1]]);
+        if(same){
+            continue;
+        }
+        kept[rows] = i;
+        uint8_t *row = image + rows * row_size;
+        for(int k = 0; k < sym->guard_left && guard; k += 2){
+            row[k / 8] |= 0x80 >> (k % 8);
+        }
+        for(int j = 0; j < data_cols; j++){
+            if(job->packed[i][j / 64] >> (j % 64) & 1){
+                int x = sym->guard_left + j;
+                row[x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+        rows++;
+    }
+    uint8_t *marker = image + (rows + 1) * row_size;
+    for(int j = 0; j < data_cols; j++){
+        if(failed_frames & (1u << (j / sym->frame_bits))){
+            int x = sym->guard_left + j;
+            marker[x / 8] |= 0x80 >> (x % 8);
+        }
+    }
+    rows += 2;
+
+    // Rows go bottom up as in the image, so the marker row is on top
+    uint8_t header[MONO_HEADER_SIZE] = {'B', 'M'};
+    put_le32(header + SIZE_OFFSET, MONO_HEADER_SIZE + rows * row_size);
+    put_le32(header + PIXEL_ARRAY_OFFSET, MONO_HEADER_SIZE);
+    put_le32(header + DIB_SIZE_OFFSET, 40);
+    put_le32(header + WIDTH_OFFSET, width);
+    put_le32(header + HEIGHT_OFFSET, rows);
+    header[0x1A] = 1;
+    header[PIXEL_SIZE_OFFSET] = 1;
+    put_le32(header + DATA_SIZE_OFFSET, rows * row_size);
+    put_le32(header + COLORS_USED_OFFSET, 2);
+
+    // Palette: 0 is white, 1 black
+    memset(header + BMP_HEADER_SIZE, 0xff, 3);
+
+    char path[4096];
+    int n = snprintf(path, sizeof(path), "%s/", options->failure_dir);
+    for(const char *c = strcmp(job->filename, "-") == 0 ? "stdin" : job->filename; *c != '\0' && n + 10 < (int)sizeof(path); c++){
+        path[n++] = *c == '/' ? '_' : *c;
+    }
+    strcpy(path + n, ".fail.bmp");
+
+    FILE *fp = fopen(path, "w");
+    if(fp == NULL || fwrite(header, 1, sizeof(header), fp) != sizeof(header)
+        || fwrite(image, row_size, rows, fp) != (size_t)rows){
+        fprintf(stderr, "Could not write %s\n", path);
+    }
+    if(fp != NULL){
+        fclose(fp);
+    }
+    free(kept);
+    free(image);
+}
+
+void decode_barcode(DecodeJob *job, const DecodeOptions *options) {
+    trace_image(job->scanlines, job->index);
+    trace(TRACE_ORIENTATION, 0, 0, job->orientation);
+    if(options->stacked){
+        decode_bands(job, options);
+    }else{
+        decode_rows(job->sym, options, job->packed, job->scanlines, &job->result);
+    }
+    if(options->failure_dir != NULL && job_failed(job, options)){
+        dump_failure(job, options);
+    }
+    free(job->guarded);
+    job->guarded = NULL;
+    free(job->packed);
+    job->packed = NULL;
+}
+
+// Small images are decoded straight from one read of the file, with no
+// heap allocations: the file and everything made from it go into thread
+// local buffers. Set the largest file with -z, 0 turns this off
+#define TINY_IMAGE_MAX (64 * 1024)
+#define TINY_MAX_ROWS 1024
+#define TINY_MAX_SCANLINES 512
+
+size_t tiny_image_bytes = TINY_IMAGE_MAX;
+
+__thread uint8_t tiny_file[TINY_IMAGE_MAX + 1];
+
+typedef struct {
+    BmpHeader header;
+    unsigned char **rows[TINY_MAX_ROWS];
+    unsigned char *pixels[TINY_IMAGE_MAX / 3];
+    unsigned char rgb[TINY_IMAGE_MAX];
+    uint8_t levels[TINY_MAX_ROWS];
+    uint64_t packed[TINY_MAX_SCANLINES][MAX_ROW_WORDS];
+    bool guarded[TINY_MAX_SCANLINES];
+} TinyImage;
+
+// About 260 KB, kept per thread rather than on the stack
+__thread TinyImage tiny_image;
+
+// Make bmp rows [0, height) and columns [0, width) of the image in
+// tiny_file, clipped to the image, like read_bmp_roi
+// Returns false if they don't fit in the tiny image
+bool tiny_view(TinyImage *tiny, unsigned int height, unsigned int width, Bmp *bmp) {
+    const BmpHeader *header = &tiny->header;
+    height = height < header->height ? height : header->height;
+    width = width < header->width ? width : header->width;
+    if(height > TINY_MAX_ROWS || (size_t)height * width > TINY_IMAGE_MAX / 3){
+        return false;
+    }
+
+    const uint8_t *raw_image = tiny_file + header->pixel_array_offset;
+    for(int y = 0; y < height; y++){
+        const uint8_t *raw_row = raw_image + (size_t)y * header->row_size;
+        tiny->rows[y] = tiny->pixels + (size_t)y * width;
+        for(int x = 0; x < width; x++){
+            unsigned char *pixel = tiny->rgb + 3 * ((size_t)y * width + x);
+            pixel[BLUE] = raw_row[header->pixel_size / 8 * x + 0];
+            pixel[GREEN] = raw_row[header->pixel_size / 8 * x + 1];
+            pixel[RED] = raw_row[header->pixel_size / 8 * x + 2];
+            tiny->rows[y][x] = pixel;
+        }
+    }
+    bmp->height = height;
+    bmp->width = width;
+    bmp->pixels = tiny->rows;
+    bmp->header = &tiny->header;
+    return true;
+}
+
+// Decode a small uncompressed bmp the way load_barcode, pack_barcode and
+// decode_barcode would, filling in the job's result
+// Returns false, with nothing decoded, for any other file or for options
+// this path doesn't cover (stacked or deskewed barcodes)
+bool decode_tiny(char *filename, const DecodeOptions *options, DecodeJob *job) {
+    if(tiny_image_bytes == 0 || options->stacked || options->deskew || strcmp(filename, "-") == 0){
+        return false;
+    }
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+    ssize_t length = read(fd, tiny_file, tiny_image_bytes + 1);
+    close(fd);
+
+    TinyImage *tiny = &tiny_image;
+    BmpHeader *header = &tiny->header;
+    if(length < BMP_HEADER_SIZE || length > tiny_image_bytes || !parse_bmp_header(tiny_file, header)
+        || (uint64_t)header->pixel_array_offset + (uint64_t)header->row_size * header->height > (uint64_t)length){
+        return false;
+    }
+
+    Symbology *sym = options->sym != NULL ? options->sym : symbology_for_size(header->width, header->height);
+    if(reject_small_image(job, options, sym, header->width, header->height)){
+        return true;
+    }
+    int span = sym->guard_left + sym->frames * sym->frame_bits;
+    Bmp bmp;
+    if(!tiny_view(tiny, UINT32_MAX, span, &bmp)){
+        return false;
+    }
+    Threshold threshold = {options->threshold_mode, options->threshold_mode == THRESHOLD_FIXED ? NULL : tiny->levels};
+    if(threshold.levels != NULL){
+        fill_threshold_levels(threshold.mode, bmp, threshold.levels);
+    }
+
+    // A barcode on its side needs the bottom rows instead
+    Orientation orientation = find_orientation(sym, &threshold, bmp);
+    if(is_vertical(orientation) && header->width > bmp.width){
+        if(!tiny_view(tiny, span, UINT32_MAX, &bmp)){
+            return false;
+        }
+        if(threshold.levels != NULL){
+            fill_threshold_levels(threshold.mode, bmp, threshold.levels);
+        }
+    }
+
+    int scanlines = count_scanlines(orientation, bmp);
+    if(scanlines > TINY_MAX_SCANLINES){
+        return false;
+    }
+    if((is_vertical(orientation) ? bmp.height : bmp.width) < span){
+        scanlines = 0;
+    }else{
+        get_data_frame(sym, &threshold, orientation, tiny->packed, bmp);
+    }
+
+    job->sym = sym;
+    job->orientation = orientation;
+    job->scanlines = scanlines;
+    job->decoded = true;
+    trace_image(scanlines, job->index);
+    trace(TRACE_ORIENTATION, 0, 0, orientation);
+    decode_rows(sym, options, tiny->packed, scanlines, &job->result);
+
+    if(options->failure_dir != NULL && job_failed(job, options)){
+        for(int i = 0; i < scanlines; i++){
+            tiny->guarded[i] = scanline_has_guard(sym, &threshold, bmp, is_vertical(orientation), i);
+        }
+        job->packed = tiny->packed;
+        job->guarded = tiny->guarded;
+        dump_failure(job, options);
+        job->packed = NULL;
+        job->guarded = NULL;
+    }
+    return true;
+}
+
+// Time decoding an image on the tiny image path and the full one
+void benchmark_tiny(char *filename, const DecodeOptions *options, int iterations) {
+    for(int path = 0; path < 2; path++){
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int i = 0; i < iterations; i++){
+            DecodeJob job = {.filename = filename};
+            if(path == 0){
+                if(!decode_tiny(filename, options, &job)){
+                    printf("tiny path: not taken, see -z\n");
+                    break;
+                }
+            }else{
+                load_barcode(&job, options);
+                pack_barcode(&job, options);
+                decode_barcode(&job, options);
+                free(job.band);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%s path: %.2f us per image\n", path == 0 ? "tiny" : "full", seconds * 1e6 / iterations);
+    }
+}
+
+// Exit status of a single image turned away by screen_image
+#define EXIT_NO_BARCODE 2
+
+// Scanlines of an image screen_image looks at
+#define SCREEN_SAMPLES 3
+#define SCREEN_MAX_SPAN (64 + MAX_FRAMES * MAX_FRAME_BITS)
+
+// Pixels read by screen_image, as a Bmp of up to SCREEN_SAMPLES rows
+typedef struct {
+    unsigned char rgb[SCREEN_SAMPLES][SCREEN_MAX_SPAN][3];
+    unsigned char *pixels[SCREEN_SAMPLES][SCREEN_MAX_SPAN];
+    unsigned char **rows[SCREEN_SAMPLES];
+    uint8_t levels[SCREEN_SAMPLES];
+} ScreenSample;
+
+Bmp screen_bmp(ScreenSample *sample, int height, int width) {
+    for(int y = 0; y < height; y++){
+        for(int x = 0; x < width; x++){
+            sample->pixels[y][x] = sample->rgb[y][x];
+        }
+        sample->rows[y] = sample->pixels[y];
+    }
+    Bmp bmp = {height, width, sample->rows, NULL};
+    return bmp;
+}
+
+// Read count pixels of a bmp from (x, y) on, converted to RGB
+bool screen_read(int fd, const BmpHeader *header, uint32_t y, uint32_t x, int count, unsigned char rgb[][3]) {
+    uint8_t raw[SCREEN_MAX_SPAN * 3];
+    off_t offset = header->pixel_array_offset + (off_t)y * header->row_size + (off_t)x * 3;
+    if(pread(fd, raw, count * 3, offset) != count * 3){
+        return false;
+    }
+    for(int i = 0; i < count; i++){
+        rgb[i][BLUE] = raw[3 * i];
+        rgb[i][GREEN] = raw[3 * i + 1];
+        rgb[i][RED] = raw[3 * i + 2];
+    }
+    return true;
+}
+
+// Check the first, middle and last scanline along the rows, as has_guard
+// does. With a guard, the data columns have to be some mix of black and
+// white, since every frame starts white and ends black, and some frame has
+// to pass its parity check
+// Returns why the image can't hold a barcode this way round, or NULL
+const char *screen_rows(int fd, const BmpHeader *header, const Symbology *sym, ThresholdMode mode) {
+    int span = sym->guard_left + sym->frames * sym->frame_bits;
+    int data_cols = sym->frames * sym->frame_bits;
+    if(header->width < span){
+        return "no guard pattern on sampled rows";
+    }
+
+    ScreenSample sample;
+    Bmp bmp = screen_bmp(&sample, SCREEN_SAMPLES, span);
+    uint32_t lines[SCREEN_SAMPLES] = {0, header->height / 2, header->height - 1};
+    for(int i = 0; i < SCREEN_SAMPLES; i++){
+        if(!screen_read(fd, header, lines[i], 0, span, sample.rgb[i])){
+            return NULL;
+        }
+    }
+    Threshold threshold = {mode, mode == THRESHOLD_FIXED ? NULL : sample.levels};
+    if(threshold.levels != NULL){
+        fill_threshold_levels(mode, bmp, threshold.levels);
+    }
+
+    uint64_t packed[SCREEN_SAMPLES][MAX_ROW_WORDS];
+    get_data_frame(sym, &threshold, ORIENT_NORMAL, packed, bmp);
+    int guarded = 0;
+    int black = 0;
+    int valid_frames = 0;
+    for(int i = 0; i < SCREEN_SAMPLES; i++){
+        if(!scanline_has_guard(sym, &threshold, bmp, false, i)){
+            continue;
+        }
+        guarded++;
+        for(int j = 0; j < data_cols; j++){
+            black += (packed[i][j / 64] >> (j % 64)) & 1;
+        }
+
+        // A black first data bit means the barcode is read from the far end
+        if(packed[i][0] & 1){
+            reverse_packed_row(packed[i], data_cols);
+        }
+        uint16_t values[MAX_FRAMES];
+        int valid[MAX_FRAMES];
+        sym->decode_row(sym, packed[i], values, valid);
+        for(int f = 0; f < sym->frames; f++){
+            valid_frames += valid[f];
+        }
+    }
+
+    if(guarded == 0){
+        return "no guard pattern on sampled rows";
+    }
+    if(10 * black < guarded * data_cols || 10 * black > 9 * guarded * data_cols){
+        return "sampled rows nearly all one colour";
+    }
+    if(valid_frames == 0){
+        return "no frame on sampled rows passes its parity check";
+    }
+    return NULL;
+}
+
+// Whether a barcode on its side has a guard on the first, middle or last
+// column, from the pixels of its guard rows in those columns
+bool screen_columns(int fd, const BmpHeader *header, const Symbology *sym, ThresholdMode mode) {
+    if(sym->guard_left > SCREEN_SAMPLES){
+        return true;
+    }
+    ScreenSample sample;
+    Bmp bmp = screen_bmp(&sample, sym->guard_left, SCREEN_SAMPLES);
+    uint32_t lines[SCREEN_SAMPLES] = {0, header->width / 2, header->width - 1};
+    for(int k = 0; k < sym->guard_left; k++){
+        for(int i = 0; i < SCREEN_SAMPLES; i++){
+            if(!screen_read(fd, header, k, lines[i], 1, &sample.rgb[k][i])){
+                return true;
+            }
+        }
+    }
+    Threshold threshold = {mode, mode == THRESHOLD_FIXED ? NULL : sample.levels};
+    if(threshold.levels != NULL){
+        fill_threshold_levels(mode, bmp, threshold.levels);
+    }
+
+    for(int i = 0; i < SCREEN_SAMPLES; i++){
+        if(scanline_has_guard(sym, &threshold, bmp, true, i)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// Check made with -S before an uncompressed bmp is loaded: its sampled
+// scanlines are read for no guard or no frame that could be read, the
+// 54 byte header and the barcode's span of pixels on each sampled row and
+// column. A barcode damaged on just those rows is turned away, so this is
+// left to be asked for; images too small for the barcode are turned away
+// by the loaders either way, see reject_small_image
+// Returns why the image was turned away, NULL to decode it as usual,
+// which includes every file error, every other kind of image and stdin
+const char *screen_image(char *filename, const DecodeOptions *options) {
+    if(!options->screen_strict || !screens_images(options) || strcmp(filename, "-") == 0){
+        return NULL;
+    }
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        return NULL;
+    }
+
+    uint8_t standard_header[BMP_HEADER_SIZE];
+    BmpHeader header;
+    const char *rejected = NULL;
+    if(pread(fd, standard_header, BMP_HEADER_SIZE, 0) == BMP_HEADER_SIZE && parse_bmp_header(standard_header, &header)){
+        Symbology *sym = options->sym != NULL ? options->sym : symbology_for_size(header.width, header.height);
+        int span = sym->guard_left + sym->frames * sym->frame_bits;
+        if(span <= SCREEN_MAX_SPAN && (header.width >= span || header.height >= span)){
+            rejected = screen_rows(fd, &header, sym, options->threshold_mode);
+            if(rejected != NULL && header.height >= span && screen_columns(fd, &header, sym, options->threshold_mode)){
+                rejected = NULL;
+            }
+        }
+    }
+    close(fd);
+    return rejected;
+}
+
+void print_result(FILE *out, const DecodeResult *result) {
+
+    // If there are no valid row, show all the error columns
+    if(result->valid_row == -1){
+        if(result->count_invalid == 1){
+            fprintf(out, "Unable to read frame: %d\n", result->list_invalid[0]);
+        }else{
+            fprintf(out, "Unable to read frames:");
+            for(int i = 0; i < result->count_invalid; i++){
+                fprintf(out, " %d", result->list_invalid[i]);
+            }
+            fprintf(out, "\n");
+        }
+        return;
+    }
+
+    // If there is no parity error, show the decoded barcode
+    for(int i = 0; i + 1 < result->frames; i++) 
+    {
+        fprintf(out, "%c ", result->digits[i]);
+    }   
+    fprintf(out, "%c\n", result->digits[result->frames - 1]);
+
+    if(result->count_recovered == 1){
+        fprintf(out, "Recovered frame: %d\n", result->list_recovered[0]);
+    }else if(result->count_recovered > 1){
+        fprintf(out, "Recovered frames:");
+        for(int i = 0; i < result->count_recovered; i++){
+            fprintf(out, " %d", result->list_recovered[i]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+// Show the confidence in each digit as agreeing/valid rows, in the
+// order of the digits
+void print_confidence(FILE *out, const DecodeResult *result) {
+    if(result->rows == 0 || result->valid_row == -1){
+        return;
+    }
+    fprintf(out, "Confidence over %d rows:", result->rows);
+    for(int i = 0; i < result->frames; i++){
+        fprintf(out, " %d/%d", result->agreeing_rows[i], result->valid_rows[i]);
+    }
+    fprintf(out, "\n");
+}
+
+// Print what was read from one image, each line starting with prefix
+// Stacked images get one line per barcode, numbered from the top of the
+// image with rows counted from the top (bmp rows start at the bottom), or
+// from the left with columns when the barcodes are on their side
+void print_job(FILE *out, const DecodeJob *job, const DecodeOptions *options, const char *prefix) {
+    if(job->rejected != NULL){
+        fprintf(out, "%sNo barcode: %s\n", prefix, job->rejected);
+        return;
+    }
+    if(!options->stacked){
+        fprintf(out, "%s", prefix);
+        print_result(out, &job->result);
+        if(options->confidence){
+            print_confidence(out, &job->result);
+        }
+        return;
+    }
+
+    if(job->bands == 0){
+        fprintf(out, "%sNo barcode found\n", prefix);
+    }
+    bool vertical = is_vertical(job->orientation);
+    for(int n = 0; n < job->bands; n++){
+        const Band *band = &job->band[vertical ? n : job->bands - 1 - n];
+        int first = vertical ? band->first_row : job->scanlines - band->first_row - band->rows;
+        fprintf(out, "%sBarcode %d at %s %d-%d: ", prefix, n + 1, vertical ? "columns" : "rows", first, first + band->rows - 1);
+        print_result(out, &band->result);
+        if(options->confidence){
+            print_confidence(out, &band->result);
+        }
+    }
+}
+
+// Decoder for barcodes that arrive one scanline at a time, as from a line
+// scan camera. Rows are checked as they are pushed and dropped straight
+// away, only their tally is kept
+typedef struct {
+    // NULL until the first row if it is picked from the row width
+    Symbology *sym;
+    ThresholdMode threshold_mode;
+
+    // Started once the symbology is known
+    RowTally tally;
+
+    // Which way round the barcode is, see orient_packed_row
+    int reversed;
+
+    // Luminance histogram of the barcode columns of the rows so far, and
+    // the Otsu level of the whole image when it is known up front, or -1
+    uint32_t histogram[256];
+    int level;
+
+    // Set as soon as a row with every frame valid has been seen
+    bool done;
+    DecodeResult result;
+} LineDecoder;
+
+// Start a decoder over, for a decoder that lives on the stack
+void line_decoder_reset(LineDecoder *decoder, Symbology *sym, ThresholdMode threshold_mode) {
+    memset(decoder, 0, sizeof(LineDecoder));
+    decoder->sym = sym;
+    decoder->threshold_mode = threshold_mode;
+    decoder->reversed = -1;
+    decoder->level = -1;
+    decoder->result.valid_row = -1;
+    if (sym != NULL) {
+        tally_start(&decoder->tally, sym);
+    }
+}
+
+LineDecoder *line_decoder_create(Symbology *sym, ThresholdMode threshold_mode) {
+    LineDecoder *decoder = malloc(sizeof(LineDecoder));
+    assert_file_format(decoder != NULL);
+    line_decoder_reset(decoder, sym, threshold_mode);
+    return decoder;
+}
+
+// Add the luminance of width BGR pixels (3 bytes each, as stored in a
+// bmp) to a histogram
+void bgr_histogram(const uint8_t *bgr, unsigned int width, uint32_t histogram[256]) {
+    uint8_t rgb[3 * HISTOGRAM_BLOCK];
+    for (int x0 = 0; x0 < width; x0 += HISTOGRAM_BLOCK) {
+        int n = width - x0 < HISTOGRAM_BLOCK ? width - x0 : HISTOGRAM_BLOCK;
+        uint32_t block[256];
+        for (int x = 0; x < n; x++) {
+            rgb[3 * x + RED] = bgr[3 * (x0 + x) + 2];
+            rgb[3 * x + GREEN] = bgr[3 * (x0 + x) + 1];
+            rgb[3 * x + BLUE] = bgr[3 * (x0 + x) + 0];
+        }
+        row_histogram(rgb, n, block);
+        for (int i = 0; i < 256; i++) {
+            histogram[i] += block[i];
+        }
+    }
+}
+
+// Threshold level for the next row, over the barcode columns only as for
+// a file. THRESHOLD_OTSU uses the level of the whole image if it is known,
+// or else of every row so far, since a stream is only read once;
+// THRESHOLD_LOCAL uses the row's own, or the rows so far for a row of a
+// single colour
+int line_decoder_level(LineDecoder *decoder, const uint8_t *bgr) {
+    if (decoder->threshold_mode == THRESHOLD_FIXED) {
+        return 0;
+    }
+    if (decoder->threshold_mode == THRESHOLD_OTSU && decoder->level >= 0) {
+        return decoder->level;
+    }
+
+    uint32_t row_hist[256] = {0};
+    bgr_histogram(bgr, decoder->sym->guard_left + decoder->sym->frames * decoder->sym->frame_bits, row_hist);
+    for (int i = 0; i < 256; i++) {
+        decoder->histogram[i] += row_hist[i];
+    }
+    int level = decoder->threshold_mode == THRESHOLD_LOCAL ? otsu_level(row_hist) : -1;
+    if (level < 0) {
+        level = otsu_level(decoder->histogram);
+    }
+    return level < 0 ? 128 : level;
+}
+
+// Pack the data columns of one row of BGR pixels into bits, as they are
+// stored, black below level unless the threshold is fixed
+// Returns whether the row starts with the guard
+bool pack_bgr_row(const Symbology *sym, ThresholdMode threshold_mode, int level, const uint8_t *bgr, uint64_t bits[MAX_ROW_WORDS]) {
+    int data_cols = sym->frames * sym->frame_bits;
+
+    memset(bits, 0, sizeof(uint64_t) * MAX_ROW_WORDS);
+    bool guarded = true;
+    for (int x = 0; x < sym->guard_left + data_cols; x++) {
+        const uint8_t *pixel = bgr + 3 * x;
+        uint64_t black;
+        if (threshold_mode == THRESHOLD_FIXED) {
+            black = pixel[2] == 0;
+        } else {
+            black = ((77 * pixel[2] + 150 * pixel[1] + 29 * pixel[0]) >> 8) < level;
+        }
+        if (x < sym->guard_left) {
+            guarded &= black == (x % 2 == 0);
+        } else {
+            bits[(x - sym->guard_left) / 64] |= black << ((x - sym->guard_left) % 64);
+        }
+    }
+    return guarded;
+}
+
+// Add the next scanline of the barcode
+// Returns true once the barcode has been read, rows pushed after that are
+// ignored. Rows too narrow for the barcode count as unreadable
+bool line_decoder_push_row(LineDecoder *decoder, const uint8_t *bgr, unsigned int width) {
+    if (decoder->done) {
+        return true;
+    }
+    if (decoder->sym == NULL) {
+        decoder->sym = symbology_for_size(width, 0);
+        tally_start(&decoder->tally, decoder->sym);
+    }
+
+    Symbology *sym = decoder->sym;
+    uint16_t values[MAX_FRAMES] = {0};
+    int valid[MAX_FRAMES] = {0};
+    if (width >= sym->guard_left + sym->frames * sym->frame_bits) {
+        uint64_t bits[MAX_ROW_WORDS];
+        bool guarded = pack_bgr_row(sym, decoder->threshold_mode, line_decoder_level(decoder, bgr), bgr, bits);
+        orient_packed_row(sym, bits, guarded, &decoder->reversed);
+        sym->decode_row(sym, bits, values, valid);
+    }
+    tally_row(&decoder->tally, values, valid);
+
+    // The first row with every frame valid is the answer
+    decoder->done = decoder->tally.valid_row != -1;
+    return decoder->done;
+}
+
+// End of the stream, if no row was fully valid the result lists the frames
+// that were never valid in any row
+const DecodeResult *line_decoder_finish(LineDecoder *decoder) {
+    if (decoder->sym == NULL) {
+        decoder->sym = symbology_for_size(0, 0);
+        tally_start(&decoder->tally, decoder->sym);
+    }
+    tally_result(&decoder->tally, &decoder->result);
+    return &decoder->result;
+}
+
+void line_decoder_free(LineDecoder *decoder) {
+    free(decoder);
+}
+
+// Decode a raw stream of BGR scanlines, width pixels each with no padding
+// The result is printed as soon as one clean scanline has arrived
+void decode_line_scan(char *filename, const DecodeOptions *options, unsigned int width) {
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    check_fd(fd, filename);
+
+    uint8_t *row = malloc((size_t)width * 3);
+    assert_file_format(row != NULL);
+    trace_image(0, 0);
+    LineDecoder *decoder = line_decoder_create(options->sym, options->threshold_mode);
+    while (read_full(fd, row, (size_t)width * 3) == (size_t)width * 3) {
+        if (line_decoder_push_row(decoder, row, width)) {
+            break;
+        }
+    }
+
+    const DecodeResult *result = line_decoder_finish(decoder);
+    print_result(stdout, result);
+    if (result->valid_row == -1) {
+        trace_failure(filename);
+    }
+    line_decoder_free(decoder);
+    free(row);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+// Image bytes held at once when decoding in bounded memory (-M)
+#define BOUNDED_BLOCK_BYTES (256 * 1024)
+
+// Decode an image of any height in fixed memory
+// Rows are read a block at a time, front to back so pipes work too, and
+// pushed through a line decoder that keeps only a tally of the rows so far
+// Reading stops at the first row with every frame valid
+void decode_bounded(char *filename, const DecodeOptions *options, DecodeResult *result) {
+    bool from_stdin = strcmp(filename, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    check_fd(fd, filename);
+
+    BmpHeader header;
+    assert_file_format(read_bmp_header_fd(fd, &header));
+    uint8_t *block = malloc(BOUNDED_BLOCK_BYTES);
+    assert_file_format(block != NULL);
+
+    // Read through the rest of the header, and later through any part of a
+    // row too wide for a block
+    size_t skip = header.pixel_array_offset - BMP_HEADER_SIZE;
+    while (skip > 0) {
+        size_t n = skip < BOUNDED_BLOCK_BYTES ? skip : BOUNDED_BLOCK_BYTES;
+        assert_file_format(read_full(fd, block, n) == n);
+        skip -= n;
+    }
+
+    trace_image(header.height, 0);
+    LineDecoder *decoder = line_decoder_create(options->sym, options->threshold_mode);
+    if (header.row_size <= BOUNDED_BLOCK_BYTES) {
+        size_t rows_per_block = BOUNDED_BLOCK_BYTES / header.row_size;
+        for (uint32_t y = 0; y < header.height; y += rows_per_block) {
+            size_t rows = header.height - y < rows_per_block ? header.height - y : rows_per_block;
+            rows = read_full(fd, block, rows * header.row_size) / header.row_size;
+            bool done = false;
+            for (size_t i = 0; i < rows && !done; i++) {
+                done = line_decoder_push_row(decoder, block + i * header.row_size, header.width);
+            }
+            if (done || rows == 0) {
+                break;
+            }
+        }
+    } else {
+        // Only the start of each row can hold the barcode
+        unsigned int width = BOUNDED_BLOCK_BYTES / 3;
+        for (uint32_t y = 0; y < header.height; y++) {
+            if (read_full(fd, block, BOUNDED_BLOCK_BYTES) != BOUNDED_BLOCK_BYTES
+                || line_decoder_push_row(decoder, block, width)) {
+                break;
+            }
+            size_t rest = header.row_size - BOUNDED_BLOCK_BYTES;
+            bool short_read = false;
+            while (rest > 0 && !short_read) {
+                size_t n = rest < BOUNDED_BLOCK_BYTES ? rest : BOUNDED_BLOCK_BYTES;
+                short_read = read_full(fd, block, n) != n;
+                rest -= n;
+            }
+            if (short_read) {
+                break;
+            }
+        }
+    }
+
+    *result = *line_decoder_finish(decoder);
+    line_decoder_free(decoder);
+    free(block);
+    if (!from_stdin) {
+        close(fd);
+    }
+}
+
+// Decode a whole bmp file held in memory, scanning its rows where they lie
+// without copying the pixels out or touching the heap
+// Returns false if the buffer is not a readable bmp
+bool decode_bmp_in_place(const uint8_t *data, size_t length, const DecodeOptions *options, DecodeResult *result) {
+    BmpHeader header;
+    if (length < BMP_HEADER_SIZE || !parse_bmp_header(data, &header) || length < header.file_size
+        || (uint64_t)header.row_size * header.height > header.data_size) {
+        return false;
+    }
+
+    LineDecoder decoder;
+    Symbology *sym = options->sym != NULL ? options->sym : symbology_for_size(header.width, 0);
+    line_decoder_reset(&decoder, sym, options->threshold_mode);
+    const uint8_t *raw_image = data + header.pixel_array_offset;
+
+    // The whole image is here, so Otsu gets one level for all of it
+    int span = sym->guard_left + sym->frames * sym->frame_bits;
+    if (options->threshold_mode == THRESHOLD_OTSU && header.width >= span) {
+        uint32_t histogram[256] = {0};
+        for (int y = 0; y < header.height; y++) {
+            bgr_histogram(raw_image + (size_t)y * header.row_size, span, histogram);
+        }
+        decoder.level = otsu_level(histogram);
+        decoder.level = decoder.level < 0 ? 128 : decoder.level;
+    }
+    for (int y = 0; y < header.height; y++) {
+        if (line_decoder_push_row(&decoder, raw_image + (size_t)y * header.row_size, header.width)) {
+            break;
+        }
+    }
+    *result = *line_decoder_finish(&decoder);
+    return true;
+}
+
+// Waiting on a queue or ring that is empty, or full: spin at first, since
+// work usually turns up quickly, then yield, then sleep for longer each
+// time up to IDLE_SLEEP_MAX_NS, so an idle worker doesn't hold a core
+// With a single CPU spinning only keeps the other side from running, so
+// main turns it off
+#define IDLE_SPINS 4096
+#define IDLE_YIELDS 64
+#define IDLE_SLEEP_MAX_NS 1000000
+
+int idle_spins = IDLE_SPINS;
+
+// Wait once more; idle counts the waits since there was last work, the
+// caller sets it back to 0 then
+void idle_wait(int *idle) {
+    int waits = ++*idle;
+    if (waits <= idle_spins) {
+        return;
+    }
+    if (waits <= idle_spins + IDLE_YIELDS) {
+        sched_yield();
+        return;
+    }
+    int doublings = waits - idle_spins - IDLE_YIELDS;
+    long ns = doublings < 10 ? 1000L << doublings : IDLE_SLEEP_MAX_NS;
+    struct timespec pause = {0, ns < IDLE_SLEEP_MAX_NS ? ns : IDLE_SLEEP_MAX_NS};
+    nanosleep(&pause, NULL);
+}
+
+// Frames of the ring are served by worker threads (-w) earliest deadline
+// first. Live frames always go before archive ones, which have no deadline
+// of their own; while half the ring or more is waiting for results, an
+// archive frame is dropped rather than decoded so it doesn't hold up the
+// slots of live frames behind it
+typedef struct {
+    uint64_t index;
+    uint64_t deadline;
+    uint32_t priority;
+} ServiceRequest;
+
+typedef struct {
+    ShmRingHeader *ring;
+    const DecodeOptions *options;
+    char *name;
+
+    // Heap of frames waiting for a worker, the most urgent first
+    pthread_mutex_t lock;
+    ServiceRequest *waiting;
+    int count;
+
+    // Whether each frame from published on has its result, by slot
+    bool *done;
+    uint64_t published;
+    bool closed;
+
+    // Frames decoded, late and dropped, by priority
+    uint64_t decoded[2];
+    uint64_t late[2];
+    uint64_t dropped[2];
+} Service;
+
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+bool request_before(const ServiceRequest *a, const ServiceRequest *b) {
+    if (a->priority != b->priority) {
+        return a->priority < b->priority;
+    }
+    if (a->deadline != b->deadline) {
+        return a->deadline < b->deadline;
+    }
+    return a->index < b->index;
+}
+
+// Add a frame to the heap, with the lock held
+void push_request(Service *service, ServiceRequest request) {
+    int i = service->count;
+    while (i > 0 && request_before(&request, &service->waiting[(i - 1) / 2])) {
+        service->waiting[i] = service->waiting[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    service->waiting[i] = request;
+    __atomic_store_n(&service->count, service->count + 1, __ATOMIC_RELEASE);
+}
+
+// Take the most urgent frame off the heap, with the lock held
+ServiceRequest pop_request(Service *service) {
+    ServiceRequest top = service->waiting[0];
+    int count = service->count - 1;
+    ServiceRequest last = service->waiting[count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && request_before(&service->waiting[child + 1], &service->waiting[child])) {
+            child++;
+        }
+        if (!request_before(&service->waiting[child], &last)) {
+            break;
+        }
+        service->waiting[i] = service->waiting[child];
+        i = child;
+    }
+    service->waiting[i] = last;
+    __atomic_store_n(&service->count, count, __ATOMIC_RELEASE);
+    return top;
+}
+
+// Decode one frame, or drop it, into its result slot, then hand back
+// every slot whose frame and all those before it are done
+void serve_frame(Service *service, ServiceRequest request, bool drop) {
+    ShmRingHeader *ring = service->ring;
+    ShmFrame *frame = shm_ring_frame(ring, request.index);
+    ShmResult *out = shm_ring_result(ring, request.index);
+    memset(out, 0, sizeof(ShmResult));
+    out->sequence = frame->sequence;
+
+    DecodeResult result;
+    size_t length = frame->length < ring->slot_size ? frame->length : ring->slot_size;
+    if (drop) {
+        out->valid_row = SHM_RESULT_DROPPED;
+    } else {
+        trace_image(0, frame->sequence);
+        if (decode_bmp_in_place((const uint8_t *)(frame + 1), length, service->options, &result)) {
+            out->valid_row = result.valid_row;
+            out->frames = result.frames;
+            memcpy(out->digits, result.digits, sizeof(out->digits));
+            out->count_invalid = result.count_invalid;
+            for (int i = 0; i < result.count_invalid; i++) {
+                out->list_invalid[i] = result.list_invalid[i];
+            }
+            if (result.valid_row == -1) {
+                char label[64];
+                snprintf(label, sizeof(label), "%s frame %llu", service->name, (unsigned long long)frame->sequence);
+                trace_failure(label);
+            }
+        } else {
+            out->valid_row = SHM_RESULT_BAD_FRAME;
+        }
+    }
+    out->missed_deadline = !drop && monotonic_ns() > request.deadline;
+
+    // Publish results before handing the frame slots back
+    pthread_mutex_lock(&service->lock);
+    service->decoded[request.priority] += !drop;
+    service->late[request.priority] += out->missed_deadline;
+    service->dropped[request.priority] += drop;
+    service->done[request.index & (ring->slot_count - 1)] = true;
+    uint64_t published = service->published;
+    while (service->done[published & (ring->slot_count - 1)]) {
+        service->done[published & (ring->slot_count - 1)] = false;
+        published++;
+    }
+    if (published != service->published) {
+        service->published = published;
+        __atomic_store_n(&ring->result_head, published, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->frame_tail, published, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&service->lock);
+}
+
+void *service_worker(void *arg) {
+    Service *service = arg;
+    int idle = 0;
+    for (;;) {
+        if (__atomic_load_n(&service->count, __ATOMIC_ACQUIRE) == 0) {
+            if (__atomic_load_n(&service->closed, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            idle_wait(&idle);
+            continue;
+        }
+
+        pthread_mutex_lock(&service->lock);
+        if (service->count == 0) {
+            pthread_mutex_unlock(&service->lock);
+            continue;
+        }
+        idle = 0;
+        ServiceRequest request = pop_request(service);
+        uint64_t backlog = __atomic_load_n(&service->ring->frame_head, __ATOMIC_ACQUIRE) - service->published;
+        pthread_mutex_unlock(&service->lock);
+
+        bool drop = request.priority == SHM_PRIORITY_ARCHIVE && 2 * backlog >= service->ring->slot_count;
+        serve_frame(service, request, drop);
+    }
+    return NULL;
+}
+
+// Attach to a shared memory ring made by a capture process (see shm_ring.h)
+// and decode its frames on workers threads until it is closed and drained
+void serve_shm_ring(char *name, const DecodeOptions *options, int workers) {
+    int fd = shm_open(name, O_RDWR, 0);
+    check_fd(fd, name);
+    struct stat st;
+    assert_file_format(fstat(fd, &st) == 0 && st.st_size >= sizeof(ShmRingHeader));
+    ShmRingHeader *ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    assert_file_format(ring != MAP_FAILED);
+    assert_file_format(__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) == SHM_RING_MAGIC);
+    assert_file_format(ring->slot_count > 0 && (ring->slot_count & (ring->slot_count - 1)) == 0);
+    assert_file_format(shm_ring_size(ring->slot_count, ring->slot_size) <= st.st_size);
+
+    // Lookup tables are built before the first frame arrives
+    for (int i = 0; i < SYMBOLOGY_COUNT; i++) {
+        init_symbology(&symbologies[i]);
+    }
+
+    Service service;
+    memset(&service, 0, sizeof(service));
+    service.ring = ring;
+    service.options = options;
+    service.name = name;
+    service.published = ring->frame_tail;
+    service.waiting = malloc(sizeof(ServiceRequest) * ring->slot_count);
+    service.done = calloc(ring->slot_count, sizeof(bool));
+    pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+    assert_file_format(service.waiting != NULL && service.done != NULL && threads != NULL);
+    pthread_mutex_init(&service.lock, NULL);
+    for (int w = 0; w < workers; w++) {
+        pthread_create(&threads[w], NULL, service_worker, &service);
+    }
+
+    // Queue each frame as it arrives
+    uint64_t tail = ring->frame_tail;
+    int idle = 0;
+    for (;;) {
+        if (tail == __atomic_load_n(&ring->frame_head, __ATOMIC_ACQUIRE)) {
+
+            // Closed only counts once the frames sent before it are queued
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)
+                && tail == __atomic_load_n(&ring->frame_head, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            idle_wait(&idle);
+            continue;
+        }
+        idle = 0;
+
+        // The result slot for this frame must have been taken
+        int full = 0;
+        while (tail - __atomic_load_n(&ring->result_tail, __ATOMIC_ACQUIRE) >= ring->slot_count) {
+            idle_wait(&full);
+        }
+
+        ShmFrame *frame = shm_ring_frame(ring, tail);
+        ServiceRequest request = {tail, frame->deadline != 0 ? frame->deadline : UINT64_MAX,
+            frame->priority == SHM_PRIORITY_ARCHIVE ? SHM_PRIORITY_ARCHIVE : SHM_PRIORITY_LIVE};
+        pthread_mutex_lock(&service.lock);
+        push_request(&service, request);
+        pthread_mutex_unlock(&service.lock);
+        tail++;
+    }
+
+    __atomic_store_n(&service.closed, true, __ATOMIC_RELEASE);
+    for (int w = 0; w < workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    fprintf(stderr, "live: %llu decoded, %llu late\n",
+        (unsigned long long)service.decoded[SHM_PRIORITY_LIVE], (unsigned long long)service.late[SHM_PRIORITY_LIVE]);
+    fprintf(stderr, "archive: %llu decoded, %llu late, %llu dropped\n",
+        (unsigned long long)service.decoded[SHM_PRIORITY_ARCHIVE], (unsigned long long)service.late[SHM_PRIORITY_ARCHIVE],
+        (unsigned long long)service.dropped[SHM_PRIORITY_ARCHIVE]);
+
+    pthread_mutex_destroy(&service.lock);
+    free(threads);
+    free(service.waiting);
+    free(service.done);
+    munmap(ring, st.st_size);
+}
+
+// Batch decoding runs as a pipeline of stages, each with its own threads:
+// readers load images, packers threshold and pack them, decoders check
+// parity, and the main thread writes the results out in order
+#define PIPELINE_STAGES 4
+#define STAGE_READ 0
+#define STAGE_PACK 1
+#define STAGE_DECODE 2
+#define STAGE_WRITE 3
+
+// Jobs that can wait between two workers, a power of two
+#define PIPELINE_QUEUE 16
+
+// Bounded single producer, single consumer queue of pointers
+// head is only written by the producer and tail only by the consumer, and
+// they sit on separate cache lines, so no locks are needed
+typedef struct {
+    void **slots;
+    uint64_t capacity;
+    char pad0[64];
+
+    uint64_t head;
+    char pad1[64];
+
+    uint64_t tail;
+    char pad2[64];
+
+    // Queue depth seen by the producer at each push
+    uint64_t depth_max;
+    uint64_t depth_sum;
+    uint64_t pushes;
+} Ring;
+
+// Sent down every queue by a worker when it has no more jobs
+char end_of_stream;
+
+void ring_init(Ring *ring, uint64_t capacity) {
+    memset(ring, 0, sizeof(Ring));
+    ring->capacity = capacity;
+    ring->slots = malloc(sizeof(void *) * capacity);
+    assert_file_format(ring->slots != NULL);
+}
+
+// Add an item, waiting while the queue is full so a slow stage holds back
+// the ones before it
+void ring_push(Ring *ring, void *item) {
+    uint64_t head = ring->head;
+    uint64_t depth;
+    int full = 0;
+    while ((depth = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == ring->capacity) {
+        idle_wait(&full);
+    }
+
+    ring->slots[head & (ring->capacity - 1)] = item;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (item == &end_of_stream) {
+        return;
+    }
+    ring->depth_max = depth + 1 > ring->depth_max ? depth + 1 : ring->depth_max;
+    ring->depth_sum += depth + 1;
+    ring->pushes++;
+}
+
+// Take the oldest item, NULL if the queue is empty
+void *ring_pop(Ring *ring) {
+    uint64_t tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    void *item = ring->slots[tail & (ring->capacity - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// A file of a batch, with the size and mtime (in nanoseconds) that tell
+// one version of it from another
+typedef struct {
+    char *path;
+    uint64_t size;
+    int64_t mtime;
+} BatchFile;
+
+typedef struct {
+    const DecodeOptions *options;
+    BatchFile *files;
+    int count;
+
+    int workers[PIPELINE_STAGES];
+
+    // Every worker of a stage has its own queue to every worker of the next
+    // rings[s][i * workers[s + 1] + j] runs from worker i of stage s to
+    // worker j of stage s + 1
+    Ring *rings[PIPELINE_STAGES - 1];
+} Pipeline;
+
+typedef struct {
+    Pipeline *pipeline;
+    int stage;
+    int index;
+
+    // Next worker of the following stage to hand a job to
+    int next;
+} Worker;
+
+// Hand a job to the next stage, round robin over its workers
+// With workers pinned, worker i is on node i % numa_nodes, and jobs stay
+// among the next stage's workers on the same node when it has any
+void send_job(Worker *worker, void *job) {
+    Pipeline *pipeline = worker->pipeline;
+    int consumers = pipeline->workers[worker->stage + 1];
+    ring_push(&pipeline->rings[worker->stage][worker->index * consumers + worker->next], job);
+    if (numa_nodes > 1 && worker->index % numa_nodes < consumers) {
+        worker->next = worker->next + numa_nodes < consumers ? worker->next + numa_nodes : worker->index % numa_nodes;
+    } else {
+        worker->next = (worker->next + 1) % consumers;
+    }
+}
+
+// Take the next job from any worker of the previous stage
+// Returns NULL once all of them have finished
+void *receive_job(Worker *worker, int *open) {
+    Pipeline *pipeline = worker->pipeline;
+    int producers = pipeline->workers[worker->stage - 1];
+    int consumers = pipeline->workers[worker->stage];
+
+    int idle = 0;
+    while (*open > 0) {
+        for (int i = 0; i < producers; i++) {
+            void *job = ring_pop(&pipeline->rings[worker->stage - 1][i * consumers + worker->index]);
+            if (job == &end_of_stream) {
+                (*open)--;
+            } else if (job != NULL) {
+                return job;
+            }
+        }
+        idle_wait(&idle);
+    }
+    return NULL;
+}
+
+// Run a worker's stage on a job
+// If the image turns out to be bad the job carries the error on through
+// the later stages, and whatever it had allocated is dropped
+void run_stage(Worker *worker, DecodeJob *job) {
+    const DecodeOptions *options = worker->pipeline->options;
+    jmp_buf recovery;
+    if (setjmp(recovery) != 0) {
+        image_recovery = NULL;
+        job->error = image_error;
+        if (job->bmp.header != NULL) {
+            free_bmp(job->bmp);
+            job->bmp.header = NULL;
+        }
+        free(job->packed);
+        free(job->guarded);
+        free(job->band);
+        job->packed = NULL;
+        job->guarded = NULL;
+        job->band = NULL;
+        job->bands = 0;
+        return;
+    }
+    if (job->error != NULL || job->decoded || job->rejected != NULL) {
+        return;
+    }
+
+    image_recovery = &recovery;
+    if (worker->stage == STAGE_READ) {
+        // Images with no barcode are turned away, and tiny images decoded,
+        // as they are read; the later stages pass them on
+        job->rejected = screen_image(job->filename, options);
+        if (job->rejected != NULL) {
+        } else if (worker->pipeline->files[job->index].size <= tiny_image_bytes && decode_tiny(job->filename, options, job)) {
+            if (job_failed(job, options)) {
+                trace_failure(job->filename);
+            }
+        } else {
+            load_barcode(job, options);
+        }
+    } else if (worker->stage == STAGE_PACK) {
+        pack_barcode(job, options);
+    } else {
+        decode_barcode(job, options);
+        if (job_failed(job, options)) {
+            trace_failure(job->filename);
+        }
+    }
+    image_recovery = NULL;
+}
+
+void *pipeline_worker(void *arg) {
+    Worker *worker = arg;
+    Pipeline *pipeline = worker->pipeline;
+    if (numa_nodes > 0) {
+        pin_to_node(worker->index % numa_nodes);
+    }
+
+    if (worker->stage == STAGE_READ) {
+
+        // Readers split the files between them
+        for (int f = worker->index; f < pipeline->count; f += pipeline->workers[STAGE_READ]) {
+            DecodeJob *job = calloc(1, sizeof(DecodeJob));
+            assert_file_format(job != NULL);
+            job->index = f;
+            job->filename = pipeline->files[f].path;
+            run_stage(worker, job);
+            send_job(worker, job);
+        }
+    } else {
+        int open = pipeline->workers[worker->stage - 1];
+        DecodeJob *job;
+        while ((job = receive_job(worker, &open)) != NULL) {
+            run_stage(worker, job);
+            send_job(worker, job);
+        }
+    }
+
+    // Tell every worker of the next stage this one is done
+    for (int j = 0; j < pipeline->workers[worker->stage + 1]; j++) {
+        ring_push(&pipeline->rings[worker->stage][worker->index * pipeline->workers[worker->stage + 1] + j], &end_of_stream);
+    }
+    return NULL;
+}
+
+// Add every file under a directory to a list
+void collect_files(char *path, BatchFile **files, int *count, int *capacity) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open directory %s\n", path);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char entry_path[4096];
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+
+        struct stat st;
+        if (stat(entry_path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            collect_files(entry_path, files, count, capacity);
+            continue;
+        }
+
+        if (*count == *capacity) {
+            *capacity = *capacity * 2 + 16;
+            *files = realloc(*files, sizeof(BatchFile) * *capacity);
+            assert_file_format(*files != NULL);
+        }
+        BatchFile *file = &(*files)[*count];
+        file->path = malloc(strlen(entry_path) + 1);
+        assert_file_format(file->path != NULL);
+        strcpy(file->path, entry_path);
+        file->size = st.st_size;
+        file->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        (*count)++;
+    }
+
+    closedir(dir);
+}
+
+int compare_batch_files(const void *a, const void *b) {
+    return strcmp(((const BatchFile *)a)->path, ((const BatchFile *)b)->path);
+}
+
+// Print how full the queues into each stage got
+// A stage whose input queue stays full is the one holding the batch back
+void print_queue_stats(Pipeline *pipeline) {
+    char *names[PIPELINE_STAGES] = {"read", "pack", "decode", "write"};
+
+    fprintf(stderr, "stage\tworkers\tqueue max\tqueue avg\n");
+    for (int s = STAGE_PACK; s < PIPELINE_STAGES; s++) {
+        uint64_t depth_max = 0;
+        uint64_t depth_sum = 0;
+        uint64_t pushes = 0;
+        for (int r = 0; r < pipeline->workers[s - 1] * pipeline->workers[s]; r++) {
+            Ring *ring = &pipeline->rings[s - 1][r];
+            depth_max = ring->depth_max > depth_max ? ring->depth_max : depth_max;
+            depth_sum += ring->depth_sum;
+            pushes += ring->pushes;
+        }
+        fprintf(stderr, "%s\t%d\t%llu\t%.2f\n", names[s], pipeline->workers[s],
+            (unsigned long long)depth_max, pushes == 0 ? 0.0 : (double)depth_sum / pushes);
+    }
+}
+
+// Results of a directory batch can be appended to a journal, so a run that
+// is stopped part way picks up where it left off. Each line is one file:
+//   size<TAB>mtime<TAB>path<TAB>result
+// with backslashes, tabs and newlines in the path and result escaped
+// Files in the journal that have not changed since are skipped
+//
+// Lines are written and fsynced in batches, a crash loses at most the last
+// batch and those files are decoded again. A line cut short by the crash
+// is dropped when the journal is next opened
+#define JOURNAL_SYNC_RECORDS 256
+#define JOURNAL_SYNC_SECONDS 2
+
+typedef struct {
+    char *path;
+    int fd;
+
+    // Lines waiting to be written
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    int pending;
+    time_t last_sync;
+
+    // Open addressing set of the keys of journaled files, 0 is an empty
+    // slot. key_slots is a power of two
+    uint64_t *keys;
+    size_t key_slots;
+    size_t key_count;
+} Journal;
+
+void check_journal(bool condition, Journal *journal) {
+    if(!condition){
+        fprintf(stderr, "Could not use journal %s\n", journal->path);
+        exit(1);
+    }
+}
+
+// Key for one version of a file, FNV-1a over its path, size and mtime
+uint64_t file_key(const char *path, size_t length, uint64_t size, int64_t mtime) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < length; i++){
+        hash = (hash ^ (uint8_t)path[i]) * 0x100000001b3ULL;
+    }
+    uint64_t fields[2] = {size, (uint64_t)mtime};
+    for(int f = 0; f < 2; f++){
+        for(int i = 0; i < 64; i += 8){
+            hash = (hash ^ ((fields[f] >> i) & 0xff)) * 0x100000001b3ULL;
+        }
+    }
+    return hash != 0 ? hash : 1;
+}
+
+void journal_insert(Journal *journal, uint64_t key) {
+    if(2 * (journal->key_count + 1) > journal->key_slots){
+        uint64_t *old_keys = journal->keys;
+        size_t old_slots = journal->key_slots;
+        journal->key_slots = old_slots > 0 ? old_slots * 2 : 1024;
+        journal->keys = calloc(journal->key_slots, sizeof(uint64_t));
+        assert_file_format(journal->keys != NULL);
+        journal->key_count = 0;
+        for(size_t i = 0; i < old_slots; i++){
+            if(old_keys[i] != 0){
+                journal_insert(journal, old_keys[i]);
+            }
+        }
+        free(old_keys);
+    }
+
+    size_t mask = journal->key_slots - 1;
+    size_t i = key & mask;
+    while(journal->keys[i] != 0){
+        if(journal->keys[i] == key){
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    journal->keys[i] = key;
+    journal->key_count++;
+}
+
+bool journal_contains(const Journal *journal, uint64_t key) {
+    if(journal->key_slots == 0){
+        return false;
+    }
+    size_t mask = journal->key_slots - 1;
+    for(size_t i = key & mask; journal->keys[i] != 0; i = (i + 1) & mask){
+        if(journal->keys[i] == key){
+            return true;
+        }
+    }
+    return false;
+}
+
+// Undo journal_escape in place, returns the new length
+size_t journal_unescape(char *text, size_t length) {
+    size_t out = 0;
+    for(size_t i = 0; i < length; i++){
+        if(text[i] == '\\' && i + 1 < length){
+            i++;
+            text[out++] = text[i] == 'n' ? '\n' : text[i] == 't' ? '\t' : text[i];
+        }else{
+            text[out++] = text[i];
+        }
+    }
+    return out;
+}
+
+// Load the keys of the files already in a journal, creating it if needed
+void journal_open(Journal *journal, char *path) {
+    memset(journal, 0, sizeof(Journal));
+    journal->path = path;
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    check_journal(journal->fd >= 0, journal);
+
+    FILE *fp = fdopen(dup(journal->fd), "r");
+    check_journal(fp != NULL, journal);
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    off_t complete = 0;
+    while((length = getline(&line, &line_capacity, fp)) > 0 && line[length - 1] == '\n'){
+        unsigned long long size;
+        long long mtime;
+        int start = 0;
+        if(sscanf(line, "%llu\t%lld\t%n", &size, &mtime, &start) == 2 && start > 0){
+            char *name = line + start;
+            char *end = strchr(name, '\t');
+            if(end != NULL){
+                journal_insert(journal, file_key(name, journal_unescape(name, end - name), size, mtime));
+            }
+        }
+        complete += length;
+    }
+    free(line);
+    fclose(fp);
+
+    struct stat st;
+    check_journal(fstat(journal->fd, &st) == 0, journal);
+    if(st.st_size > complete){
+        check_journal(ftruncate(journal->fd, complete) == 0, journal);
+    }
+    journal->last_sync = time(NULL);
+}
+
+void journal_append(Journal *journal, const char *text, size_t length) {
+    if(journal->length + length > journal->capacity){
+        journal->capacity = (journal->length + length) * 2;
+        journal->buffer = realloc(journal->buffer, journal->capacity);
+        assert_file_format(journal->buffer != NULL);
+    }
+    memcpy(journal->buffer + journal->length, text, length);
+    journal->length += length;
+}
+
+void journal_escape(Journal *journal, const char *text, size_t length) {
+    for(size_t i = 0; i < length; i++){
+        char *escaped = text[i] == '\\' ? "\\\\" : text[i] == '\t' ? "\\t" : text[i] == '\n' ? "\\n" : NULL;
+        if(escaped != NULL){
+            journal_append(journal, escaped, 2);
+        }else{
+            journal_append(journal, &text[i], 1);
+        }
+    }
+}
+
+// Write out and fsync the waiting lines
+void journal_sync(Journal *journal) {
+    size_t written = 0;
+    while(written < journal->length){
+        ssize_t n = write(journal->fd, journal->buffer + written, journal->length - written);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        check_journal(n > 0, journal);
+        written += n;
+    }
+    check_journal(fsync(journal->fd) == 0, journal);
+    journal->length = 0;
+    journal->pending = 0;
+    journal->last_sync = time(NULL);
+}
+
+// Add a finished file to the journal, the result as it would be printed
+// Files that couldn't be opened or read aren't finished, see image_open_error
+void journal_record(Journal *journal, const BatchFile *file, const DecodeJob *job, const DecodeOptions *options) {
+    if(job->error == image_open_error || job->error == image_read_error){
+        return;
+    }
+    char *result = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&result, &length);
+    check_journal(out != NULL, journal);
+    if(job->error != NULL){
+        fprintf(out, "%s\n", job->error);
+    }else{
+        print_job(out, job, options, "");
+    }
+    fclose(out);
+
+    char fields[64];
+    int n = snprintf(fields, sizeof(fields), "%llu\t%lld\t", (unsigned long long)file->size, (long long)file->mtime);
+    journal_append(journal, fields, n);
+    journal_escape(journal, file->path, strlen(file->path));
+    journal_append(journal, "\t", 1);
+    journal_escape(journal, result, length > 0 && result[length - 1] == '\n' ? length - 1 : length);
+    journal_append(journal, "\n", 1);
+    free(result);
+
+    journal->pending++;
+    if(journal->pending >= JOURNAL_SYNC_RECORDS || time(NULL) - journal->last_sync >= JOURNAL_SYNC_SECONDS){
+        journal_sync(journal);
+    }
+}
+
+void journal_close(Journal *journal) {
+    journal_sync(journal);
+    close(journal->fd);
+    free(journal->buffer);
+    free(journal->keys);
+}
+
+// Counts of what a batch read, printed as a summary instead of a line per
+// file. Each code is packed into a 64 bit key, a nibble per digit holding
+// the digit plus one, so codes of different lengths never share a key and
+// 0 is free to mark an empty slot of the open addressing table
+typedef struct {
+    uint64_t *keys;
+    uint64_t *counts;
+    size_t slots;
+    size_t used;
+
+    uint64_t images;
+    uint64_t read;
+    uint64_t unreadable;
+    uint64_t rejected;
+    uint64_t errors;
+
+    // How often each frame was the one that could not be read
+    uint64_t invalid_frames[MAX_FRAMES];
+} CodeCounts;
+
+uint64_t code_key(const DecodeResult *result) {
+    uint64_t key = 0;
+    for(int i = 0; i < result->frames; i++){
+        key = (key << 4) | (uint64_t)(result->digits[i] - '0' + 1);
+    }
+    return key;
+}
+
+void count_code(CodeCounts *counts, uint64_t key) {
+    if(2 * (counts->used + 1) > counts->slots){
+        uint64_t *old_keys = counts->keys;
+        uint64_t *old_counts = counts->counts;
+        size_t old_slots = counts->slots;
+        counts->slots = old_slots > 0 ? old_slots * 2 : 1024;
+        counts->keys = calloc(counts->slots, sizeof(uint64_t));
+        counts->counts = calloc(counts->slots, sizeof(uint64_t));
+        assert_file_format(counts->keys != NULL && counts->counts != NULL);
+        size_t mask = counts->slots - 1;
+        for(size_t i = 0; i < old_slots; i++){
+            if(old_keys[i] != 0){
+                size_t j = old_keys[i] & mask;
+                while(counts->keys[j] != 0){
+                    j = (j + 1) & mask;
+                }
+                counts->keys[j] = old_keys[i];
+                counts->counts[j] = old_counts[i];
+            }
+        }
+        free(old_keys);
+        free(old_counts);
+    }
+
+    // Keys are spread with a multiplicative hash, the low nibbles of
+    // similar codes are too alike to index by directly
+    size_t mask = counts->slots - 1;
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+    while(counts->keys[i] != 0 && counts->keys[i] != key){
+        i = (i + 1) & mask;
+    }
+    if(counts->keys[i] == 0){
+        counts->keys[i] = key;
+        counts->used++;
+    }
+    counts->counts[i]++;
+}
+
+void count_result(CodeCounts *counts, const DecodeResult *result) {
+    if(result->valid_row == -1){
+        counts->unreadable++;
+        for(int i = 0; i < result->count_invalid; i++){
+            counts->invalid_frames[result->list_invalid[i]]++;
+        }
+    }else{
+        counts->read++;
+        count_code(counts, code_key(result));
+    }
+}
+
+// Count every code read from an image, one per barcode when stacked
+void count_job(CodeCounts *counts, const DecodeJob *job, const DecodeOptions *options) {
+    counts->images++;
+    if(job->error != NULL){
+        counts->errors++;
+    }else if(job->rejected != NULL){
+        counts->rejected++;
+    }else if(!options->stacked){
+        count_result(counts, &job->result);
+    }else{
+        for(int b = 0; b < job->bands; b++){
+            count_result(counts, &job->band[b].result);
+        }
+    }
+}
+
+// Slots of a CodeCounts, for sorting by count
+const CodeCounts *sorting_counts;
+
+int compare_code_slots(const void *a, const void *b) {
+    uint64_t count_a = sorting_counts->counts[*(const size_t *)a];
+    uint64_t count_b = sorting_counts->counts[*(const size_t *)b];
+    uint64_t key_a = sorting_counts->keys[*(const size_t *)a];
+    uint64_t key_b = sorting_counts->keys[*(const size_t *)b];
+    if(count_a != count_b){
+        return count_a < count_b ? 1 : -1;
+    }
+    return key_a < key_b ? -1 : key_a > key_b;
+}
+
+// Print the counts, most common code first, and start counting again
+void print_code_counts(FILE *out, CodeCounts *counts) {
+    fprintf(out, "Summary of %llu images: %llu codes read, %llu unreadable, %llu without a barcode, %llu not images\n",
+        (unsigned long long)counts->images, (unsigned long long)counts->read, (unsigned long long)counts->unreadable,
+        (unsigned long long)counts->rejected, (unsigned long long)counts->errors);
+
+    size_t *order = malloc(sizeof(size_t) * (counts->used > 0 ? counts->used : 1));
+    assert_file_format(order != NULL);
+    size_t n = 0;
+    for(size_t i = 0; i < counts->slots; i++){
+        if(counts->keys[i] != 0){
+            order[n++] = i;
+        }
+    }
+    sorting_counts = counts;
+    qsort(order, n, sizeof(size_t), compare_code_slots);
+
+    for(size_t i = 0; i < n; i++){
+        char code[2 * MAX_FRAMES];
+        int length = 0;
+        for(uint64_t key = counts->keys[order[i]]; key != 0; key >>= 4){
+            length++;
+        }
+        for(int d = 0; d < length; d++){
+            code[2 * d] = '0' + (int)(counts->keys[order[i]] >> (4 * (length - 1 - d)) & 0xf) - 1;
+            code[2 * d + 1] = d + 1 < length ? ' ' : '\0';
+        }
+        fprintf(out, "%llu\t%s\n", (unsigned long long)counts->counts[order[i]], code);
+    }
+    if(counts->unreadable > 0){
+        fprintf(out, "Unreadable frames (frame:count):");
+        for(int f = 0; f < MAX_FRAMES; f++){
+            if(counts->invalid_frames[f] > 0){
+                fprintf(out, " %d:%llu", f, (unsigned long long)counts->invalid_frames[f]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    free(order);
+
+    free(counts->keys);
+    free(counts->counts);
+    memset(counts, 0, sizeof(CodeCounts));
+}
+
+// Decode every file under a directory, printing "file: result" lines in
+// file name order. A file that can't be read gets its error as its result
+// With a journal, files it already has are skipped and new results added
+// With summary_every 0 or more, the codes are counted instead and a summary
+// printed every summary_every images, or only at the end when it is 0
+void run_pipeline(char *path, const DecodeOptions *options, int workers[PIPELINE_STAGES], bool queue_stats, char *journal_path, int summary_every) {
+    Pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.options = options;
+    memcpy(pipeline.workers, workers, sizeof(pipeline.workers));
+    pipeline.workers[STAGE_WRITE] = 1;
+
+    int capacity = 0;
+    collect_files(path, &pipeline.files, &pipeline.count, &capacity);
+    if (pipeline.count > 0) {
+        qsort(pipeline.files, pipeline.count, sizeof(BatchFile), compare_batch_files);
+    }
+
+    Journal journal;
+    if (journal_path != NULL) {
+        journal_open(&journal, journal_path);
+        int kept = 0;
+        for (int i = 0; i < pipeline.count; i++) {
+            BatchFile *file = &pipeline.files[i];
+            if (journal_contains(&journal, file_key(file->path, strlen(file->path), file->size, file->mtime))) {
+                free(file->path);
+            } else {
+                pipeline.files[kept++] = *file;
+            }
+        }
+        if (kept < pipeline.count) {
+            fprintf(stderr, "Skipped %d files already in %s\n", pipeline.count - kept, journal_path);
+        }
+        pipeline.count = kept;
+    }
+
+    // Lookup tables are built up front, workers only read them
+    for (int i = 0; i < SYMBOLOGY_COUNT; i++) {
+        init_symbology(&symbologies[i]);
+    }
+
+    for (int s = 0; s + 1 < PIPELINE_STAGES; s++) {
+        int rings = pipeline.workers[s] * pipeline.workers[s + 1];
+        pipeline.rings[s] = malloc(sizeof(Ring) * rings);
+        assert_file_format(pipeline.rings[s] != NULL);
+        for (int r = 0; r < rings; r++) {
+            ring_init(&pipeline.rings[s][r], PIPELINE_QUEUE);
+        }
+    }
+
+    int thread_count = pipeline.workers[STAGE_READ] + pipeline.workers[STAGE_PACK] + pipeline.workers[STAGE_DECODE];
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    Worker *thread_workers = malloc(sizeof(Worker) * (thread_count + 1));
+    assert_file_format(threads != NULL && thread_workers != NULL);
+    int t = 0;
+    for (int s = STAGE_READ; s < STAGE_WRITE; s++) {
+        for (int i = 0; i < pipeline.workers[s]; i++) {
+            int next = numa_nodes > 1 && i % numa_nodes < pipeline.workers[s + 1] ? i % numa_nodes : i % pipeline.workers[s + 1];
+            thread_workers[t] = (Worker){&pipeline, s, i, next};
+            pthread_create(&threads[t], NULL, pipeline_worker, &thread_workers[t]);
+            t++;
+        }
+    }
+
+    // Write results in file order, holding back any that finish early
+    Worker writer = {&pipeline, STAGE_WRITE, 0, 0};
+    DecodeJob **done = calloc(pipeline.count > 0 ? pipeline.count : 1, sizeof(DecodeJob *));
+    assert_file_format(done != NULL);
+    int open = pipeline.workers[STAGE_DECODE];
+    int next = 0;
+    CodeCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    DecodeJob *job;
+    while ((job = receive_job(&writer, &open)) != NULL) {
+        done[job->index] = job;
+        while (next < pipeline.count && done[next] != NULL) {
+            char prefix[4096];
+            snprintf(prefix, sizeof(prefix), "%s: ", done[next]->filename);
+            if (summary_every >= 0) {
+                count_job(&counts, done[next], options);
+                if (summary_every > 0 && counts.images == (uint64_t)summary_every) {
+                    print_code_counts(stdout, &counts);
+                }
+            } else if (done[next]->error != NULL) {
+                printf("%s%s\n", prefix, done[next]->error);
+            } else {
+                print_job(stdout, done[next], options, prefix);
+            }
+            if (journal_path != NULL) {
+                journal_record(&journal, &pipeline.files[next], done[next], options);
+            }
+            free(done[next]->band);
+            free(done[next]);
+            next++;
+        }
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // The last interval, or the whole batch
+    if (summary_every >= 0 && (summary_every == 0 || counts.images > 0)) {
+        print_code_counts(stdout, &counts);
+    }
+
+    if (queue_stats) {
+        print_queue_stats(&pipeline);
+    }
+
+    for (int s = 0; s + 1 < PIPELINE_STAGES; s++) {
+        for (int r = 0; r < pipeline.workers[s] * pipeline.workers[s + 1]; r++) {
+            free(pipeline.rings[s][r].slots);
+        }
+        free(pipeline.rings[s]);
+    }
+    if (journal_path != NULL) {
+        journal_close(&journal);
+    }
+    for (int i = 0; i < pipeline.count; i++) {
+        free(pipeline.files[i].path);
+    }
+    free(pipeline.files);
+    free(done);
+    free(threads);
+    free(thread_workers);
+}
+
+int main(int argc, char** argv){
+    char *filename = argv[1];
+    if(filename == NULL){
+        printf("No bmp image filename provided.\n");
+        return 0;
+    }
+
+    // Get flags
+    bool describe = false;
+    bool queue_stats = false;
+    DecodeOptions options = {NULL, THRESHOLD_FIXED, false, false, false, false, NULL, true, false};
+    int workers[PIPELINE_STAGES] = {1, 1, 1, 1};
+    int line_width = 0;
+    bool shm_ring = false;
+    int service_workers = 1;
+    bool bounded = false;
+    char *journal_path = NULL;
+    int summary_every = -1;
+    char *trace_file = NULL;
+    bool numa = false;
+    int benchmark = 0;
+    for(int i = 2; i < argc; i++){
+        if(strcmp(argv[i], "-d") == 0){
+            describe = true;
+        }else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+            options.sym = find_symbology(argv[++i]);
+            if(options.sym == NULL){
+                fprintf(stderr, "Unknown symbology %s\n", argv[i]);
+                return 1;
+            }
+        }else if(strcmp(argv[i], "-k") == 0){
+            options.deskew = true;
+        }else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc){
+            line_width = atoi(argv[++i]);
+            if(line_width <= 0){
+                fprintf(stderr, "Line width must be a number of pixels\n");
+                return 1;
+            }
+        }else if(strcmp(argv[i], "-r") == 0){
+            options.recover = true;
+        }else if(strcmp(argv[i], "-c") == 0){
+            options.confidence = true;
+        }else if(strcmp(argv[i], "-b") == 0){
+            options.stacked = true;
+        }else if(strcmp(argv[i], "-M") == 0){
+            bounded = true;
+        }else if(strcmp(argv[i], "-m") == 0){
+            shm_ring = true;
+        }else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc){
+            service_workers = atoi(argv[++i]);
+            if(service_workers < 1){
+                fprintf(stderr, "Service workers must be at least 1\n");
+                return 1;
+            }
+        }else if(strcmp(argv[i], "-a") == 0 && i + 1 < argc){
+            summary_every = atoi(argv[++i]);
+            if(summary_every < 0){
+                fprintf(stderr, "Summary interval must be a number of images, 0 for one summary\n");
+                return 1;
+            }
+        }else if(strcmp(argv[i], "-H") == 0 && i + 1 < argc){
+            i++;
+            if(strcmp(argv[i], "off") == 0){
+                hugepage_mode = HUGEPAGES_OFF;
+            }else if(strcmp(argv[i], "thp") == 0){
+                hugepage_mode = HUGEPAGES_THP;
+            }else if(strcmp(argv[i], "hugetlb") == 0){
+                hugepage_mode = HUGEPAGES_HUGETLB;
+            }else{
+                fprintf(stderr, "Unknown huge page mode %s\n", argv[i]);
+                return 1;
+            }
+        }else if(strcmp(argv[i], "-e") == 0){
+            options.screen = false;
+        }else if(strcmp(argv[i], "-S") == 0){
+            options.screen_strict = true;
+        }else if(strcmp(argv[i], "-z") == 0 && i + 1 < argc){
+            int bytes = atoi(argv[++i]);
+            if(bytes < 0 || bytes > TINY_IMAGE_MAX){
+                fprintf(stderr, "Tiny image size must be 0 to %d bytes\n", TINY_IMAGE_MAX);
+                return 1;
+            }
+            tiny_image_bytes = bytes;
+        }else if(strcmp(argv[i], "-B") == 0 && i + 1 < argc){
+            benchmark = atoi(argv[++i]);
+            if(benchmark <= 0){
+                fprintf(stderr, "Benchmark needs a number of runs\n");
+                return 1;
+            }
+        }else if(strcmp(argv[i], "-N") == 0){
+            numa = true;
+        }else if(strcmp(argv[i], "-F") == 0 && i + 1 < argc){
+            options.failure_dir = argv[++i];
+        }else if(strcmp(argv[i], "-T") == 0 && i + 1 < argc){
+            trace_file = argv[++i];
+        }else if(strcmp(argv[i], "-J") == 0 && i + 1 < argc){
+            journal_path = argv[++i];
+        }else if(strcmp(argv[i], "-q") == 0){
+            queue_stats = true;
+        }else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc){
+            i++;
+            if(sscanf(argv[i], "%d,%d,%d", &workers[0], &workers[1], &workers[2]) != 3 || workers[0] < 1 || workers[1] < 1 || workers[2] < 1){
+                fprintf(stderr, "Worker counts must look like 2,2,1\n");
+                return 1;
+            }
+        }else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc){
+            i++;
+            if(strcmp(argv[i], "fixed") == 0){
+                options.threshold_mode = THRESHOLD_FIXED;
+            }else if(strcmp(argv[i], "otsu") == 0){
+                options.threshold_mode = THRESHOLD_OTSU;
+            }else if(strcmp(argv[i], "local") == 0){
+                options.threshold_mode = THRESHOLD_LOCAL;
+            }else{
+                fprintf(stderr, "Unknown threshold %s\n", argv[i]);
+                return 1;
+            }
+        }else{
+            fprintf(stderr, "Unknown flag %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Tilted scanlines don't line up with image rows to split into bands
+    if(options.stacked && options.deskew){
+        fprintf(stderr, "Stacked barcodes can't be deskewed\n");
+        return 1;
+    }
+
+    // Bounded memory never holds more than a block of rows
+    if(bounded && (options.stacked || options.deskew || options.recover)){
+        fprintf(stderr, "Bounded memory decoding can't be combined with -b, -k or -r\n");
+        return 1;
+    }
+
+    // Rows are only kept for a failure dump when whole images are decoded
+    if(options.failure_dir != NULL && (bounded || shm_ring || line_width > 0)){
+        fprintf(stderr, "Failure dumps can't be combined with -M, -m or -l\n");
+        return 1;
+    }
+
+    // Check flag, only the header is needed to describe an image
+    if(describe){
+        struct stat st;
+        if(stat(filename, &st) == 0 && S_ISDIR(st.st_mode)){
+            scan_bmp_directory(filename);
+            return 0;
+        }
+
+        uint32_t width, height;
+        if(strcmp(filename, "-") == 0){
+            BmpHeader header = read_bmp_header(filename);
+            width = header.width;
+            height = header.height;
+        }else{
+            int fd = open(filename, O_RDONLY);
+            check_fd(fd, filename);
+            assert_file_format(read_image_size_fd(fd, &width, &height));
+            close(fd);
+        }
+        printf("Read file %s\n", filename);
+        printf("Width: %d\n", width);
+        printf("Height: %d\n", height);
+        return 0;
+    }
+
+    if(sysconf(_SC_NPROCESSORS_ONLN) <= 1){
+        idle_spins = 0;
+    }
+
+    // Pipeline workers are pinned once the nodes are known
+    if(numa){
+        numa_nodes = find_numa_nodes();
+    }
+
+    // Record decisions, dumped for images that fail
+    if(trace_file != NULL){
+        trace_start(trace_file);
+    }
+
+    // Frames from a capture process over shared memory
+    if(shm_ring){
+        serve_shm_ring(filename, &options, service_workers);
+        return 0;
+    }
+
+    // Raw scanlines, decoded as they arrive
+    if(line_width > 0){
+        decode_line_scan(filename, &options, line_width);
+        return 0;
+    }
+
+    // One image of any height, in fixed memory
+    if(bounded){
+        DecodeResult result;
+        decode_bounded(filename, &options, &result);
+        if(result.valid_row == -1){
+            trace_failure(filename);
+        }
+        print_result(stdout, &result);
+        if(options.confidence){
+            print_confidence(stdout, &result);
+        }
+        return 0;
+    }
+
+    // Decode every file in a directory through the pipeline
+    struct stat st;
+    bool found = strcmp(filename, "-") != 0 && stat(filename, &st) == 0;
+    if(found && S_ISDIR(st.st_mode)){
+        run_pipeline(filename, &options, workers, queue_stats, journal_path, summary_every);
+        return 0;
+    }
+
+    if(journal_path != NULL || summary_every >= 0){
+        fprintf(stderr, "A journal or summary is only kept for a directory of images\n");
+        return 1;
+    }
+
+    // Time the tiny image path against the full one
+    if(benchmark > 0){
+        benchmark_tiny(filename, &options, benchmark);
+        return 0;
+    }
+
+    DecodeJob job = {.filename = filename};
+    // Only files that fit are tried on the tiny path, as in a batch
+    bool tiny = found && st.st_size <= tiny_image_bytes;
+    job.rejected = screen_image(filename, &options);
+    if(job.rejected == NULL && !(tiny && decode_tiny(filename, &options, &job))){
+        load_barcode(&job, &options);
+        if(job.rejected == NULL){
+            pack_barcode(&job, &options);
+            decode_barcode(&job, &options);
+        }
+    }
+    if(job.rejected != NULL){
+        print_job(stdout, &job, &options, "");
+        return EXIT_NO_BARCODE;
+    }
+    if(job_failed(&job, &options)){
+        trace_failure(filename);
+    }
+    print_job(stdout, &job, &options, "");
+    free(job.band);
 
+    return 0;
 }
\ No newline at end of file
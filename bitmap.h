@@ -1,6 +1,8 @@
 #ifndef _BITMAP_H
 #define _BITMAP_H
 
+#include <stddef.h>
+
 // NOTE: you do not need to edit this file
 
 #define RED 0
@@ -27,14 +29,31 @@ typedef struct {
 } Bmp;
 
 // Open an image
+// A filename of "-" reads the image from stdin
 Bmp read_bmp(char *filename); 
 
+// Open an image from memory, buf holds the whole file (len bytes)
+Bmp read_bmp_mem(const void *buf, size_t len);
+
+// Open only rows [row, row + height) and columns [col, col + width) of an
+// image, ranges past the edge of the image are clipped
+Bmp read_bmp_roi(char *filename, unsigned int row, unsigned int height, unsigned int col, unsigned int width);
+
 // Write an image to a file
 void write_bmp(Bmp, char *filename);
 
 // Copy an image
+// The copy shares pixels with the original, see bmp_row_for_write
 Bmp copy_bmp(Bmp bmp);
 
+// Make a view of rows [row, row + height) and columns [col, col + width)
+// of an image, sharing its pixels. Free it with free_bmp like any image
+Bmp view_bmp(Bmp bmp, unsigned int row, unsigned int height, unsigned int col, unsigned int width);
+
+// Get a row of an image to change its pixels
+// Copies and views share rows, so always write through this
+unsigned char **bmp_row_for_write(Bmp bmp, unsigned int row);
+
 // Free an image
 // Make sure this is called once for every Bmp you create
 void free_bmp(Bmp);
@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "shm_ring.h"
+
+// Stand in for the capture process: creates a shared memory ring, sends
+// bmp files through it and prints the results the reader sends back
+// Usage: ./shm_producer /ring_name [-l ms | -a] file.bmp...
+// -l sends the files after it live, each due ms after it is sent, and -a
+// sends them as archive work. Files before either are live with no deadline
+// then start the reader with: ./main /ring_name -m
+
+#define SLOT_COUNT 8
+
+void print_result(char *filename, ShmResult *result) {
+    printf("%s%s: ", filename, result->missed_deadline ? " (late)" : "");
+    if (result->valid_row == SHM_RESULT_BAD_FRAME) {
+        printf("File format error\n");
+    } else if (result->valid_row == SHM_RESULT_DROPPED) {
+        printf("Dropped\n");
+    } else if (result->valid_row == -1) {
+        printf(result->count_invalid == 1 ? "Unable to read frame:" : "Unable to read frames:");
+        for (int i = 0; i < result->count_invalid; i++) {
+            printf(" %d", result->list_invalid[i]);
+        }
+        printf("\n");
+    } else {
+        for (int i = 0; i < result->frames; i++) {
+            printf(i + 1 < result->frames ? "%c " : "%c\n", result->digits[i]);
+        }
+    }
+}
+
+// Print every result the reader has finished
+void take_results(ShmRingHeader *ring, char **files) {
+    uint64_t head = __atomic_load_n(&ring->result_head, __ATOMIC_ACQUIRE);
+    while (ring->result_tail < head) {
+        ShmResult *result = shm_ring_result(ring, ring->result_tail);
+        print_result(files[result->sequence], result);
+        __atomic_store_n(&ring->result_tail, ring->result_tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("Usage: %s /ring_name [-l ms | -a] file.bmp...\n", argv[0]);
+        return 0;
+    }
+    char *name = argv[1];
+
+    // Each file with its priority and how long the reader has for it
+    char **files = malloc(sizeof(char *) * argc);
+    uint32_t *priority = malloc(sizeof(uint32_t) * argc);
+    uint64_t *budget = malloc(sizeof(uint64_t) * argc);
+    if (files == NULL || priority == NULL || budget == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int count = 0;
+    uint32_t next_priority = SHM_PRIORITY_LIVE;
+    uint64_t next_budget = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            next_priority = SHM_PRIORITY_LIVE;
+            next_budget = (uint64_t)(atof(argv[++i]) * 1e6);
+        } else if (strcmp(argv[i], "-a") == 0) {
+            next_priority = SHM_PRIORITY_ARCHIVE;
+            next_budget = 0;
+        } else {
+            files[count] = argv[i];
+            priority[count] = next_priority;
+            budget[count] = next_budget;
+            count++;
+        }
+    }
+    if (count == 0) {
+        fprintf(stderr, "No files to send\n");
+        return 1;
+    }
+
+    // Slots are sized for the largest file
+    uint32_t slot_size = 0;
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        if (stat(files[i], &st) != 0) {
+            fprintf(stderr, "Could not open file %s\n", files[i]);
+            return 1;
+        }
+        slot_size = st.st_size > slot_size ? st.st_size : slot_size;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, shm_ring_size(SLOT_COUNT, slot_size)) != 0) {
+        fprintf(stderr, "Could not create shared memory %s\n", name);
+        return 1;
+    }
+    ShmRingHeader *ring = mmap(NULL, shm_ring_size(SLOT_COUNT, slot_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "Could not map shared memory %s\n", name);
+        return 1;
+    }
+    ring->slot_count = SLOT_COUNT;
+    ring->slot_size = slot_size;
+    __atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < count; i++) {
+
+        // Wait for a free slot
+        while (ring->frame_head - __atomic_load_n(&ring->frame_tail, __ATOMIC_ACQUIRE) == ring->slot_count) {
+            take_results(ring, files);
+            sched_yield();
+        }
+
+        ShmFrame *frame = shm_ring_frame(ring, ring->frame_head);
+        FILE *fp = fopen(files[i], "r");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not open file %s\n", files[i]);
+            return 1;
+        }
+        frame->sequence = i;
+        frame->length = fread(frame + 1, 1, slot_size, fp);
+        fclose(fp);
+        frame->priority = priority[i];
+        frame->deadline = 0;
+        if (budget[i] > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            frame->deadline = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec + budget[i];
+        }
+        __atomic_store_n(&ring->frame_head, ring->frame_head + 1, __ATOMIC_RELEASE);
+        take_results(ring, files);
+    }
+
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+    while (ring->result_tail < ring->frame_head) {
+        take_results(ring, files);
+        sched_yield();
+    }
+
+    munmap(ring, shm_ring_size(SLOT_COUNT, slot_size));
+    shm_unlink(name);
+    free(files);
+    free(priority);
+    free(budget);
+    return 0;
+}
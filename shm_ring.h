@@ -0,0 +1,106 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared memory ring between a capture process and the barcode reader
+//
+// The capture process creates the ring, copies whole bmp files into frame
+// slots and advances frame_head. The reader decodes each frame where it
+// lies in the slot, fills in the result slot with the same index, then
+// advances result_head and frame_tail. The capture process reads results
+// and advances result_tail. Every counter is only written by one side, so
+// no locks are needed between them, and nothing on the frame path makes a
+// syscall.
+//
+// The reader's workers take frames earliest deadline first, live frames
+// before archive ones, so frames can finish out of order. result_head and
+// frame_tail only move past a frame once every frame before it is done.
+
+#define SHM_RING_MAGIC 0x32524342
+#define SHM_RING_MAX_FRAMES 16
+
+// Priorities of a frame: live frames have a deadline, archive frames can
+// wait and are dropped when the reader falls behind
+#define SHM_PRIORITY_LIVE 0
+#define SHM_PRIORITY_ARCHIVE 1
+
+// valid_row of a result whose frame was not a readable bmp
+#define SHM_RESULT_BAD_FRAME -2
+
+// valid_row of an archive frame dropped unread, apart from every row the
+// decoder itself reports (-1 for none, -3 for a voted row)
+#define SHM_RESULT_DROPPED -4
+
+typedef struct {
+    uint32_t magic;
+
+    // Number of frame slots (a power of two) and bytes in each
+    uint32_t slot_count;
+    uint32_t slot_size;
+
+    // Set by the capture process once it will send no more frames
+    uint32_t closed;
+    char pad0[48];
+
+    // Each counter on its own cache line
+    uint64_t frame_head;
+    char pad1[56];
+    uint64_t frame_tail;
+    char pad2[56];
+    uint64_t result_head;
+    char pad3[56];
+    uint64_t result_tail;
+    char pad4[56];
+} ShmRingHeader;
+
+typedef struct {
+    uint64_t sequence;
+    uint32_t length;
+    uint32_t priority;
+
+    // CLOCK_MONOTONIC time in nanoseconds the result is needed by, 0 for
+    // none
+    uint64_t deadline;
+
+    // Followed by slot_size bytes of frame data
+} ShmFrame;
+
+typedef struct {
+    uint64_t sequence;
+
+    // Row the digits were read from, -1 if no row had every frame valid
+    int32_t valid_row;
+    int32_t frames;
+    char digits[SHM_RING_MAX_FRAMES];
+
+    // Frames without a single valid row, when valid_row is -1
+    int32_t count_invalid;
+    int32_t list_invalid[SHM_RING_MAX_FRAMES];
+
+    // Set if the result was ready after the frame's deadline
+    int32_t missed_deadline;
+} ShmResult;
+
+// Bytes between the starts of two frame slots
+static inline size_t shm_frame_stride(uint32_t slot_size) {
+    return (sizeof(ShmFrame) + slot_size + 63) / 64 * 64;
+}
+
+// Bytes of shared memory needed for a ring
+static inline size_t shm_ring_size(uint32_t slot_count, uint32_t slot_size) {
+    return sizeof(ShmRingHeader) + slot_count * shm_frame_stride(slot_size) + slot_count * sizeof(ShmResult);
+}
+
+static inline ShmFrame *shm_ring_frame(ShmRingHeader *ring, uint64_t index) {
+    uint8_t *frames = (uint8_t *)(ring + 1);
+    return (ShmFrame *)(frames + (index & (ring->slot_count - 1)) * shm_frame_stride(ring->slot_size));
+}
+
+static inline ShmResult *shm_ring_result(ShmRingHeader *ring, uint64_t index) {
+    uint8_t *results = (uint8_t *)(ring + 1) + ring->slot_count * shm_frame_stride(ring->slot_size);
+    return (ShmResult *)results + (index & (ring->slot_count - 1));
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+// Decision trace of the barcode reader
+//
+// Every thread always records what it decided into a ring of its own,
+// with no locks or syscalls, so the trace stays on in production. The
+// rings are only written out, to the file given with -T, when a decode
+// fails (the ring of the thread that decoded it, then those of any
+// threads that decoded its stacked barcodes) or on a signal (every ring).
+// trace_print reads the file back.
+//
+// A trace file is a run of dumps, each one:
+//   TraceDumpHeader
+//   name_length bytes: the image that failed, or empty for a signal
+//   per ring: TraceRingHeader then events TraceEvents, oldest first
+
+#define TRACE_MAGIC 0x31435254
+
+// Events kept in each ring, a power of two
+#define TRACE_EVENTS 4096
+
+// Why the rings were written out
+#define TRACE_DUMP_FAILURE 1
+#define TRACE_DUMP_SIGNAL 2
+
+// Kinds of event, and what their fields hold
+enum {
+    // Start of a decode: row is the number of scanlines, value the index
+    // of the image in its batch
+    TRACE_IMAGE = 1,
+
+    // value is the Orientation the image is read in
+    TRACE_ORIENTATION,
+
+    // One scanline: row is its index, value has bit f set if frame f
+    // passed its parity check
+    TRACE_ROW,
+
+    // End of the rows: row is the one the digits were read from, as an
+    // int32_t (-1 for none), value has bit f set if frame f was valid in
+    // some row
+    TRACE_RESULT,
+
+    // A frame read from the row vote: row is 1 if the voted frame passed
+    // its parity check, value is the voted frame value
+    TRACE_VOTE,
+
+    // One barcode of a stacked image: row is its first scanline, value its
+    // number of scanlines
+    TRACE_BAND
+};
+
+typedef struct {
+    // Count of events the thread had recorded before this one
+    uint32_t sequence;
+    uint8_t type;
+    uint8_t frame;
+    uint16_t reserved;
+    uint32_t row;
+    uint32_t value;
+} TraceEvent;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t reason;
+
+    // Signal number for TRACE_DUMP_SIGNAL
+    uint32_t signal;
+    uint32_t rings;
+    uint32_t name_length;
+} TraceDumpHeader;
+
+typedef struct {
+    // Order the thread first recorded in, from 0
+    uint32_t thread;
+    uint32_t events;
+} TraceRingHeader;
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+// Print the decision trace dumped by ./main -T trace_file
+// Usage: ./trace_print trace_file
+
+char *orientations[] = {"normal", "reversed", "vertical", "vertical reversed"};
+
+// Frames with bit f set in mask, as "0 1 5", or "none"
+void print_frames(uint32_t mask) {
+    if (mask == 0) {
+        printf(" none");
+    }
+    for (int f = 0; f < 32; f++) {
+        if (mask & (1u << f)) {
+            printf(" %d", f);
+        }
+    }
+}
+
+void print_event(const TraceEvent *event) {
+    printf("  %8u  ", event->sequence);
+    switch (event->type) {
+    case TRACE_IMAGE:
+        printf("image %u, %u scanlines\n", event->value, event->row);
+        break;
+    case TRACE_ORIENTATION:
+        printf("orientation %s\n", event->value < 4 ? orientations[event->value] : "unknown");
+        break;
+    case TRACE_ROW:
+        printf("row %u valid frames:", event->row);
+        print_frames(event->value);
+        printf("\n");
+        break;
+    case TRACE_RESULT:
+        if ((int32_t)event->row == -1) {
+            printf("no row valid, frames valid in some row:");
+            print_frames(event->value);
+            printf("\n");
+        } else {
+            printf("digits read from row %d\n", (int32_t)event->row);
+        }
+        break;
+    case TRACE_VOTE:
+        printf("frame %u voted value %u, parity %s\n", event->frame, event->value, event->row ? "valid" : "invalid");
+        break;
+    case TRACE_BAND:
+        printf("barcode at rows %u-%u\n", event->row, event->row + event->value - 1);
+        break;
+    default:
+        printf("unknown event %u\n", event->type);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s trace_file\n", argv[0]);
+        return 0;
+    }
+    FILE *fp = fopen(argv[1], "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open file %s\n", argv[1]);
+        return 1;
+    }
+
+    TraceDumpHeader header;
+    while (fread(&header, sizeof(header), 1, fp) == 1) {
+        if (header.magic != TRACE_MAGIC) {
+            fprintf(stderr, "Not a trace dump\n");
+            return 1;
+        }
+
+        char *name = malloc(header.name_length + 1);
+        if (name == NULL || fread(name, 1, header.name_length, fp) != header.name_length) {
+            fprintf(stderr, "Trace cut short\n");
+            return 1;
+        }
+        name[header.name_length] = '\0';
+        if (header.reason == TRACE_DUMP_FAILURE) {
+            printf("Failed to read %s\n", name);
+        } else {
+            printf("Signal %u\n", header.signal);
+        }
+        free(name);
+
+        for (uint32_t r = 0; r < header.rings; r++) {
+            TraceRingHeader ring;
+            if (fread(&ring, sizeof(ring), 1, fp) != 1) {
+                fprintf(stderr, "Trace cut short\n");
+                return 1;
+            }
+            printf(" thread %u, last %u events\n", ring.thread, ring.events);
+            for (uint32_t e = 0; e < ring.events; e++) {
+                TraceEvent event;
+                if (fread(&event, sizeof(event), 1, fp) != 1) {
+                    fprintf(stderr, "Trace cut short\n");
+                    return 1;
+                }
+                print_event(&event);
+            }
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}